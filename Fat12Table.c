@@ -1,11 +1,12 @@
 #include "Fat12Table.h"
 
 
-uint8_t *mainTable;
+//Both helpers work on the table they are given and keep no state, so any number of threads
+//may decode the same FAT at once
 
 
 uint16_t TableValue(uint16_t index,void *Table){
-    AssignTable(Table);
+    const uint8_t *mainTable=Table;
     uint16_t result=0;
 
     uint16_t tableIndex=3*index/2;
@@ -26,7 +27,8 @@ uint16_t TableValue(uint16_t index,void *Table){
 
     return result;
 }
-void AssignTableValue(uint16_t index, uint16_t value){
+void AssignTableValue(uint16_t index, uint16_t value, void *Table){
+    uint8_t *mainTable=Table;
     uint16_t tableIndex=3*index/2;
     uint8_t a,b;
     a=mainTable[tableIndex];
@@ -74,8 +76,4 @@ void AssignTableValue(uint16_t index, uint16_t value){
     mainTable[tableIndex]=newA;
     mainTable[tableIndex+1]=newB;
 
-}
-
-void AssignTable(void *table){
-    mainTable=table;
 }
\ No newline at end of file
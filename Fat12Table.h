@@ -3,8 +3,7 @@
 #include "FatStructures.h"
 
 uint16_t TableValue(uint16_t index,void *Table);
-void AssignTableValue(uint16_t index, uint16_t value);
-void AssignTable(void *table);
+void AssignTableValue(uint16_t index, uint16_t value, void *Table);
 
 
 #endif
@@ -39,6 +39,19 @@ struct __attribute__((__packed__)) SFN
     uint32_t size;
 };
 
+//VFAT long name part, stored before its SFN in reverse order with the highest order first
+struct __attribute__((__packed__)) LFN
+{
+    uint8_t order; //1 based, 0x40 marks the last part of the name
+    uint16_t name_1[5];
+    uint8_t attributes; //always 0x0f
+    uint8_t type;
+    uint8_t checksum; //of the 8.3 name the long name belongs to
+    uint16_t name_2[6];
+    uint16_t first_cluster; //always 0
+    uint16_t name_3[2];
+};
+
 
 struct __attribute__((__packed__)) bootSectorFat {
     char unused[3]; //Assembly code instructions to jump to boot code (mandatory in bootable partition)
@@ -0,0 +1,435 @@
+#include "checksum.h"
+#include "parallel.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#define CHECKSUM_RUN_CLUSTERS 64
+
+
+static uint32_t crc32cTable[256];
+static int crc32cHardware;
+
+static void __attribute__((constructor)) Crc32cInit(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int j = 0; j < 8; j++)crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78u : crc >> 1;
+        crc32cTable[i] = crc;
+    }
+#if defined(__x86_64__)
+    crc32cHardware = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("sse4.2")))
+static uint32_t Crc32cHardware(uint32_t crc, const uint8_t *bytes, size_t size) {
+    uint64_t wide = crc;
+    for (; size && ((uintptr_t) bytes & 7); size--)wide = _mm_crc32_u8((uint32_t) wide, *bytes++);
+    for (; size >= 8; size -= 8, bytes += 8) {
+        uint64_t word;
+        memcpy(&word, bytes, 8);
+        wide = _mm_crc32_u64(wide, word);
+    }
+    for (; size; size--)wide = _mm_crc32_u8((uint32_t) wide, *bytes++);
+    return (uint32_t) wide;
+}
+
+#endif
+
+uint32_t crc32c_update(uint32_t crc, const void *data, size_t size) {
+    const uint8_t *bytes = data;
+    crc = ~crc;
+#if defined(__x86_64__)
+    if (crc32cHardware)return ~Crc32cHardware(crc, bytes, size);
+#endif
+    for (size_t i = 0; i < size; i++)crc = crc32cTable[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+
+static const uint32_t sha256Constants[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void Sha256Block(struct sha256_t *ctx, const uint8_t *block) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t) block[i * 4] << 24 | (uint32_t) block[i * 4 + 1] << 16 |
+               (uint32_t) block[i * 4 + 2] << 8 | block[i * 4 + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = ctx->state[0], b = ctx->state[1], c = ctx->state[2], d = ctx->state[3];
+    uint32_t e = ctx->state[4], f = ctx->state[5], g = ctx->state[6], h = ctx->state[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + sha256Constants[i] + w[i];
+        uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    ctx->state[0] += a;
+    ctx->state[1] += b;
+    ctx->state[2] += c;
+    ctx->state[3] += d;
+    ctx->state[4] += e;
+    ctx->state[5] += f;
+    ctx->state[6] += g;
+    ctx->state[7] += h;
+}
+
+void sha256_init(struct sha256_t *ctx) {
+    static const uint32_t initial[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    memcpy(ctx->state, initial, sizeof(initial));
+    ctx->length = 0;
+    ctx->used = 0;
+}
+
+void sha256_update(struct sha256_t *ctx, const void *data, size_t size) {
+    const uint8_t *bytes = data;
+    ctx->length += size;
+    if (ctx->used) {
+        size_t take = 64 - ctx->used < size ? 64 - ctx->used : size;
+        memcpy(ctx->block + ctx->used, bytes, take);
+        ctx->used += take;
+        bytes += take;
+        size -= take;
+        if (ctx->used < 64)return;
+        Sha256Block(ctx, ctx->block);
+        ctx->used = 0;
+    }
+    for (; size >= 64; size -= 64, bytes += 64)Sha256Block(ctx, bytes);
+    memcpy(ctx->block, bytes, size);
+    ctx->used = size;
+}
+
+void sha256_final(struct sha256_t *ctx, uint8_t digest[32]) {
+    uint64_t bits = ctx->length * 8;
+    ctx->block[ctx->used++] = 0x80;
+    if (ctx->used > 56) {
+        memset(ctx->block + ctx->used, 0, 64 - ctx->used);
+        Sha256Block(ctx, ctx->block);
+        ctx->used = 0;
+    }
+    memset(ctx->block + ctx->used, 0, 56 - ctx->used);
+    for (int i = 0; i < 8; i++)ctx->block[56 + i] = (uint8_t) (bits >> (56 - i * 8));
+    Sha256Block(ctx, ctx->block);
+    for (int i = 0; i < 8; i++) {
+        digest[i * 4] = (uint8_t) (ctx->state[i] >> 24);
+        digest[i * 4 + 1] = (uint8_t) (ctx->state[i] >> 16);
+        digest[i * 4 + 2] = (uint8_t) (ctx->state[i] >> 8);
+        digest[i * 4 + 3] = (uint8_t) ctx->state[i];
+    }
+}
+
+
+struct checksum_job_t {
+    struct volume_t *volume;
+    struct file_digest_t *digests;
+    const uint16_t *firstClusters; //per digest
+    int flags;
+};
+
+struct checksum_file_t {
+    char path[FAT_WALK_PATH_LENGTH];
+    uint16_t first_cluster;
+    uint32_t size;
+};
+
+struct checksum_tree_t {
+    pthread_mutex_t lock; //guards files
+    struct checksum_file_t *files;
+    size_t count;
+    size_t capacity;
+    int failed;
+};
+
+//Reads the chain in runs of contiguous clusters, one disk_read per run
+static int DigestFile(struct volume_t *volume, struct file_digest_t *digest, uint16_t firstCluster, int flags) {
+    struct sha256_t sha;
+    sha256_init(&sha);
+    uint32_t crc = 0;
+    size_t left = digest->size;
+    int status = 0;
+
+    struct clusters_chain_t *chain = NULL;
+    char *buffer = NULL;
+    size_t clusterBytes = (size_t) volume->fatInfo.sectors_per_clusters * SECTOR_SIZE;
+    if (left) {
+        chain = get_chain_fat12(volume->FAT1, volume->fatInfo.bytes_per_sector * volume->fatInfo.size_of_fat, firstCluster);
+        if (!chain)return errno ? errno : EIO;
+        buffer = malloc(clusterBytes * CHECKSUM_RUN_CLUSTERS);
+        if (!buffer) {
+            free(chain->clusters);
+            free(chain);
+            return ENOMEM;
+        }
+    }
+
+    for (size_t i = 0; left && i < chain->size;) {
+        size_t run = 1;
+        while (i + run < chain->size && run < CHECKSUM_RUN_CLUSTERS &&
+               run * clusterBytes < left &&
+               chain->clusters[i + run] == chain->clusters[i] + run)
+            run++;
+
+        if (disk_read(volume->disk, fat_cluster_sector(volume, chain->clusters[i]), buffer,
+                      (int32_t) (run * volume->fatInfo.sectors_per_clusters)) == -1) {
+            status = errno;
+            break;
+        }
+        size_t used = run * clusterBytes < left ? run * clusterBytes : left;
+        crc = crc32c_update(crc, buffer, used);
+        if (flags & FAT_DIGEST_SHA256)sha256_update(&sha, buffer, used);
+        left -= used;
+        i += run;
+    }
+    if (!status && left)status = EIO;
+
+    digest->crc32c = crc;
+    if (flags & FAT_DIGEST_SHA256)sha256_final(&sha, digest->sha256);
+
+    free(buffer);
+    if (chain) {
+        free(chain->clusters);
+        free(chain);
+    }
+    return status;
+}
+
+static void DigestTask(size_t index, void *context) {
+    struct checksum_job_t *job = context;
+    if (job->digests[index].status)return;
+    job->digests[index].status = DigestFile(job->volume, job->digests + index, job->firstClusters[index], job->flags);
+}
+
+//fat_walk pre callback: every regular file of the tree
+static int CollectFile(const struct fat_walk_entry_t *entry, void *context) {
+    struct checksum_tree_t *tree = context;
+    if (entry->is_directory)return FAT_WALK_CONTINUE;
+
+    pthread_mutex_lock(&tree->lock);
+    if (tree->count == tree->capacity) {
+        size_t capacity = tree->capacity ? tree->capacity * 2 : 64;
+        struct checksum_file_t *grown = realloc(tree->files, capacity * sizeof(struct checksum_file_t));
+        if (!grown) {
+            tree->failed = 1;
+            pthread_mutex_unlock(&tree->lock);
+            return FAT_WALK_STOP;
+        }
+        tree->files = grown;
+        tree->capacity = capacity;
+    }
+    struct checksum_file_t *file = tree->files + tree->count++;
+    strcpy(file->path, entry->path);
+    file->first_cluster = entry->sfn->low_order_address_of_first_cluster;
+    file->size = entry->sfn->size;
+    pthread_mutex_unlock(&tree->lock);
+    return FAT_WALK_CONTINUE;
+}
+
+static int ComparePaths(const void *a, const void *b) {
+    return strcasecmp(((const struct checksum_file_t *) a)->path, ((const struct checksum_file_t *) b)->path);
+}
+
+static int CollectTree(struct volume_t *pvolume, int threads, struct checksum_tree_t *tree) {
+    memset(tree, 0, sizeof(*tree));
+    if (pthread_mutex_init(&tree->lock, NULL))return -1;
+    struct fat_walk_options_t walk = {CollectFile, NULL, tree, 0, threads};
+    int err = fat_walk(pvolume, &walk) != 0;
+    if (err && tree->failed)errno = ENOMEM;
+    pthread_mutex_destroy(&tree->lock);
+    if (err) {
+        free(tree->files);
+        return -1;
+    }
+    //walk order depends on the threads, the manifest should not
+    qsort(tree->files, tree->count, sizeof(struct checksum_file_t), ComparePaths);
+    return 0;
+}
+
+int fat_checksum_files(struct volume_t *pvolume, const char **names, size_t count, int flags, int threads,
+                       struct file_digest_t **digests, size_t *digest_count) {
+    if (!pvolume || !digests || !digest_count || (!names && count)) {
+        errno = EFAULT;
+        return -1;
+    }
+    for (size_t i = 0; names && i < count; i++) {
+        //room for the leading backslash added to names given without one
+        if (strlen(names[i]) + 2 > FAT_WALK_PATH_LENGTH) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+    }
+
+    struct checksum_tree_t tree;
+    if (CollectTree(pvolume, threads, &tree))return -1;
+    size_t total = names ? count : tree.count;
+
+    struct file_digest_t *result = calloc(total ? total : 1, sizeof(struct file_digest_t));
+    uint16_t *firstClusters = calloc(total ? total : 1, sizeof(uint16_t));
+    if (!result || !firstClusters) {
+        free(result);
+        free(firstClusters);
+        free(tree.files);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for (size_t i = 0; i < total; i++) {
+        struct checksum_file_t *file = tree.files + i;
+        if (names) {
+            struct checksum_file_t key;
+            snprintf(key.path, sizeof(key.path), "%s%s", names[i][0] == '\\' || names[i][0] == '/' ? "" : "\\", names[i]);
+            for (char *c = key.path; *c; c++)if (*c == '/')*c = '\\';
+            file = bsearch(&key, tree.files, tree.count, sizeof(struct checksum_file_t), ComparePaths);
+            strcpy(result[i].name, key.path);
+            if (!file) {
+                result[i].status = ENOENT;
+                continue;
+            }
+        } else {
+            strcpy(result[i].name, file->path);
+        }
+        result[i].size = file->size;
+        firstClusters[i] = file->first_cluster;
+    }
+    free(tree.files);
+
+    struct checksum_job_t job = {pvolume, result, firstClusters, flags};
+    parallel_for(total, threads, DigestTask, &job);
+    free(firstClusters);
+
+    *digests = result;
+    *digest_count = total;
+    return 0;
+}
+
+int fat_manifest_write(const char *manifest_file_name, const struct file_digest_t *digests, size_t count, int flags) {
+    if (!manifest_file_name || (!digests && count)) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    FILE *out = fopen(manifest_file_name, "w");
+    if (!out)return -1;
+
+    int err = fprintf(out, flags & FAT_DIGEST_SHA256 ? "#crc32c sha256\n" : "#crc32c\n") < 0;
+    for (size_t i = 0; !err && i < count; i++) {
+        if (digests[i].status)continue;
+        err = fprintf(out, "%s %u %08x", digests[i].name, digests[i].size, digests[i].crc32c) < 0;
+        if (flags & FAT_DIGEST_SHA256) {
+            err |= fputc(' ', out) == EOF;
+            for (int j = 0; j < 32; j++)err |= fprintf(out, "%02x", digests[i].sha256[j]) < 0;
+        }
+        err |= fputc('\n', out) == EOF;
+    }
+    if (fclose(out))err = 1;
+
+    return err ? -1 : 0;
+}
+
+struct manifest_line_t {
+    char name[FAT_WALK_PATH_LENGTH];
+    unsigned size;
+    unsigned crc32c;
+    char sha256[65];
+    int seen;
+};
+
+int fat_manifest_compare(const char *manifest_file_name, const struct file_digest_t *digests, size_t count,
+                         FILE *report) {
+    if (!manifest_file_name || (!digests && count)) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    FILE *in = fopen(manifest_file_name, "r");
+    if (!in)return -1;
+
+    struct manifest_line_t *lines = NULL;
+    size_t lineCount = 0, capacity = 0;
+    char text[FAT_WALK_PATH_LENGTH + 96];
+    //names are read up to the longest path a walk produces
+    char format[32];
+    snprintf(format, sizeof(format), "%%%ds %%u %%x %%64s", FAT_WALK_PATH_LENGTH - 1);
+    while (fgets(text, sizeof(text), in)) {
+        if (text[0] == '#' || text[0] == '\n')continue;
+        if (lineCount == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            struct manifest_line_t *grown = realloc(lines, capacity * sizeof(struct manifest_line_t));
+            if (!grown) {
+                free(lines);
+                fclose(in);
+                errno = ENOMEM;
+                return -1;
+            }
+            lines = grown;
+        }
+        struct manifest_line_t *line = lines + lineCount;
+        memset(line, 0, sizeof(*line));
+        if (sscanf(text, format, line->name, &line->size, &line->crc32c, line->sha256) >= 3)lineCount++;
+    }
+    fclose(in);
+
+    int mismatches = 0;
+    for (size_t i = 0; i < count; i++) {
+        struct manifest_line_t *line = NULL;
+        for (size_t j = 0; j < lineCount && !line; j++) {
+            if (!lines[j].seen && strcmp(lines[j].name, digests[i].name) == 0)line = lines + j;
+        }
+        if (!line) {
+            mismatches++;
+            if (report)fprintf(report, "extra %s\n", digests[i].name);
+            continue;
+        }
+        line->seen = 1;
+
+        int differs = digests[i].status || line->size != digests[i].size || line->crc32c != digests[i].crc32c;
+        if (!differs && line->sha256[0]) {
+            char hex[65];
+            for (int j = 0; j < 32; j++)sprintf(hex + j * 2, "%02x", digests[i].sha256[j]);
+            differs = strcmp(hex, line->sha256) != 0;
+        }
+        if (differs) {
+            mismatches++;
+            if (report)fprintf(report, "changed %s\n", digests[i].name);
+        }
+    }
+    for (size_t j = 0; j < lineCount; j++) {
+        if (lines[j].seen)continue;
+        mismatches++;
+        if (report)fprintf(report, "missing %s\n", lines[j].name);
+    }
+
+    free(lines);
+    return mismatches;
+}
@@ -0,0 +1,43 @@
+#ifndef FAT_CHECKSUM_H
+#define FAT_CHECKSUM_H
+#include "file_reader.h"
+#include "tree_walk.h"
+
+#define FAT_DIGEST_SHA256 1 //also compute SHA-256 next to CRC32C
+
+struct file_digest_t {
+    char name[FAT_WALK_PATH_LENGTH]; //path from the root, "\\DIR\\FILE.TXT"
+    uint32_t size;
+    uint32_t crc32c;
+    uint8_t sha256[32];
+    int status; //0 or the errno of the failed open/read
+};
+
+struct sha256_t {
+    uint32_t state[8];
+    uint64_t length;
+    uint8_t block[64];
+    size_t used;
+};
+
+//CRC32C (Castagnoli), SSE4.2 crc32 instruction when the CPU has it, table driven otherwise
+uint32_t crc32c_update(uint32_t crc, const void *data, size_t size);
+
+void sha256_init(struct sha256_t *ctx);
+void sha256_update(struct sha256_t *ctx, const void *data, size_t size);
+void sha256_final(struct sha256_t *ctx, uint8_t digest[32]);
+
+//Digests every regular file of the volume in path order (names == NULL) or the named files, given as paths
+//from the root, streaming their clusters straight from the disk on up to threads threads. A name that is
+//not a file gets status ENOENT, one longer than FAT_WALK_PATH_LENGTH fails with ENAMETOOLONG.
+//*digests is allocated and must be freed
+int fat_checksum_files(struct volume_t *pvolume, const char **names, size_t count, int flags, int threads,
+                       struct file_digest_t **digests, size_t *digest_count);
+
+int fat_manifest_write(const char *manifest_file_name, const struct file_digest_t *digests, size_t count, int flags);
+//Number of files that are missing, extra or differ from the manifest, each reported to report when not NULL.
+//digests must be computed with the flags the manifest was written with
+int fat_manifest_compare(const char *manifest_file_name, const struct file_digest_t *digests, size_t count,
+                         FILE *report);
+
+#endif
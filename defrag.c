@@ -0,0 +1,325 @@
+#include "defrag.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define DEFRAG_COPY_SECTORS 64
+
+
+static int ChainedEntry(const struct SFN *entry) {
+    if (entry->filename[0] == 0x0 || entry->filename[0] == (char) 0xe5 || entry->filename[0] == '.')return 0;
+    if ((entry->file_attributes & (1 << 3)) >> 3)return 0;
+    return entry->low_order_address_of_first_cluster >= 2;
+}
+
+static size_t FatBytes(struct volume_t *pvolume) {
+    return pvolume->fatInfo.bytes_per_sector * pvolume->fatInfo.size_of_fat;
+}
+
+static uint32_t ClusterLimit(struct volume_t *pvolume) {
+    uint32_t dataStart = fat_cluster_sector(pvolume, 2);
+    uint32_t clusters = 0;
+    if (pvolume->disk->numberOfSectors > dataStart && pvolume->fatInfo.sectors_per_clusters)
+        clusters = (pvolume->disk->numberOfSectors - dataStart) / pvolume->fatInfo.sectors_per_clusters;
+    uint32_t fatEntries = FatBytes(pvolume) / 3 * 2;
+    if (clusters + 2 > fatEntries)clusters = fatEntries > 2 ? fatEntries - 2 : 0;
+    return clusters + 2; //one past the last usable cluster number
+}
+
+
+struct tree_object_t {
+    char path[DEFRAG_PATH_LENGTH];
+    int is_directory;
+    struct clusters_chain_t *chain;
+};
+
+struct tree_t {
+    struct tree_object_t *objects;
+    size_t count;
+    size_t capacity;
+    uint8_t *claimed; //per cluster, set once a chain of the tree owns it
+    uint32_t limit;
+};
+
+static void FreeTree(struct tree_t *tree) {
+    for (size_t i = 0; i < tree->count; i++) {
+        free(tree->objects[i].chain->clusters);
+        free(tree->objects[i].chain);
+    }
+    free(tree->objects);
+    free(tree->claimed);
+}
+
+struct tree_walk_t {
+    struct volume_t *volume;
+    struct tree_t *tree;
+    int error;
+};
+
+//fat_walk pre callback: every file and directory that owns a chain
+static int AddEntry(const struct fat_walk_entry_t *entry, void *context) {
+    struct tree_walk_t *walk = context;
+    struct tree_t *tree = walk->tree;
+    if (!ChainedEntry(entry->sfn))return FAT_WALK_CONTINUE;
+    struct clusters_chain_t *chain = get_chain_fat12(walk->volume->FAT1, FatBytes(walk->volume),
+                                                     entry->sfn->low_order_address_of_first_cluster);
+    if (!chain)return FAT_WALK_CONTINUE; //broken chains are left where they are
+
+    for (size_t j = 0; j < chain->size; j++) {
+        uint16_t cluster = chain->clusters[j];
+        if (cluster < 2 || cluster >= tree->limit || tree->claimed[cluster]) {
+            //cross-linked or out of range, moving it would corrupt another file
+            free(chain->clusters);
+            free(chain);
+            walk->error = EINVAL;
+            return FAT_WALK_STOP;
+        }
+        tree->claimed[cluster] = 1;
+    }
+
+    if (tree->count == tree->capacity) {
+        size_t capacity = tree->capacity ? tree->capacity * 2 : 64;
+        struct tree_object_t *grown = realloc(tree->objects, capacity * sizeof(struct tree_object_t));
+        if (!grown) {
+            free(chain->clusters);
+            free(chain);
+            walk->error = ENOMEM;
+            return FAT_WALK_STOP;
+        }
+        tree->objects = grown;
+        tree->capacity = capacity;
+    }
+
+    struct tree_object_t *object = tree->objects + tree->count++;
+    strcpy(object->path, entry->path);
+    object->is_directory = entry->is_directory;
+    object->chain = chain;
+    return FAT_WALK_CONTINUE;
+}
+
+//Every file and directory reachable from the root, depth first in directory order
+static int CollectTree(struct volume_t *pvolume, struct tree_t *tree) {
+    memset(tree, 0, sizeof(*tree));
+    tree->limit = ClusterLimit(pvolume);
+    tree->claimed = calloc(tree->limit, 1);
+    if (!tree->claimed) {
+        errno = ENOMEM;
+        return 1;
+    }
+
+    //one thread, the layout follows the order the callbacks come in
+    struct tree_walk_t walk = {pvolume, tree, 0};
+    struct fat_walk_options_t options = {AddEntry, NULL, &walk, 0, 1};
+    if (fat_walk(pvolume, &options) != 0) {
+        if (walk.error)errno = walk.error;
+        FreeTree(tree);
+        return 1;
+    }
+
+    return 0;
+}
+
+
+struct fragmentation_report_t *fat_fragmentation(struct volume_t *pvolume) {
+    if (!pvolume) {
+        errno = EFAULT;
+        return NULL;
+    }
+
+    struct tree_t tree;
+    if (CollectTree(pvolume, &tree))return NULL;
+
+    struct fragmentation_report_t *report = calloc(1, sizeof(struct fragmentation_report_t));
+    if (report)report->files = calloc(tree.count ? tree.count : 1, sizeof(struct fragmentation_file_t));
+    if (!report || !report->files) {
+        free(report);
+        FreeTree(&tree);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    for (size_t i = 0; i < tree.count; i++) {
+        struct clusters_chain_t *chain = tree.objects[i].chain;
+        struct fragmentation_file_t *file = report->files + report->fileCount++;
+        strcpy(file->path, tree.objects[i].path);
+        file->is_directory = tree.objects[i].is_directory;
+        file->clusters = chain->size;
+        file->extents = 1;
+        for (size_t j = 1; j < chain->size; j++) {
+            if (chain->clusters[j] == chain->clusters[j - 1] + 1)continue;
+            file->extents++;
+            uint32_t gap = chain->clusters[j] > chain->clusters[j - 1] ? chain->clusters[j] - chain->clusters[j - 1] - 1
+                                                                       : chain->clusters[j - 1] - chain->clusters[j] + 1;
+            int bucket = 0;
+            while (bucket < DEFRAG_GAP_BUCKETS - 1 && gap >= (2u << bucket))bucket++;
+            report->gapHistogram[bucket]++;
+        }
+
+        report->totalClusters += file->clusters;
+        report->totalExtents += file->extents;
+        if (file->extents > 1)report->fragmentedFiles++;
+    }
+    report->averageRunLength = report->totalExtents ? (double) report->totalClusters / report->totalExtents : 0;
+
+    FreeTree(&tree);
+    return report;
+}
+
+void fat_fragmentation_free(struct fragmentation_report_t *report) {
+    if (!report)return;
+    free(report->files);
+    free(report);
+}
+
+
+static int CopySectors(struct disk_t *in, int out, uint32_t from, uint32_t to, uint32_t count, char *buffer,
+                       uint32_t bufferSectors) {
+    while (count) {
+        uint32_t step = count < bufferSectors ? count : bufferSectors;
+        ssize_t bytes = (ssize_t) step * SECTOR_SIZE;
+        if (disk_read(in, (int32_t) from, buffer, (int32_t) step) == -1)return 1;
+        if (pwrite(out, buffer, bytes, (off_t) to * SECTOR_SIZE) != bytes)return 1;
+        from += step;
+        to += step;
+        count -= step;
+    }
+    return 0;
+}
+
+//First cluster of a free run of length count at or after start, or the first free cluster when no run fits
+static uint32_t FindRun(const uint8_t *used, uint32_t start, uint32_t limit, uint32_t count) {
+    uint32_t firstFree = 0;
+    for (uint32_t cluster = start; cluster < limit; cluster++) {
+        if (used[cluster])continue;
+        if (!firstFree)firstFree = cluster;
+        uint32_t run = 1;
+        while (run < count && cluster + run < limit && !used[cluster + run])run++;
+        if (run == count)return cluster;
+        cluster += run;
+    }
+    return firstFree;
+}
+
+//Points every in-use entry of a moved directory at the new place of its first cluster, . and .. included
+static void PatchEntries(struct SFN *entries, size_t count, const uint16_t *moved, uint32_t limit) {
+    for (size_t i = 0; i < count; i++) {
+        if (entries[i].filename[0] == 0x0 || entries[i].filename[0] == (char) 0xe5)continue;
+        if ((entries[i].file_attributes & (1 << 3)) >> 3)continue;
+        uint16_t cluster = entries[i].low_order_address_of_first_cluster;
+        if (cluster >= 2 && cluster < limit && moved[cluster])entries[i].low_order_address_of_first_cluster = moved[cluster];
+    }
+}
+
+int fat_defragment(struct volume_t *pvolume, const char *output_file_name) {
+    if (!pvolume || !output_file_name) {
+        errno = EFAULT;
+        return -1;
+    }
+    if (pvolume->fatInfo.bytes_per_sector != SECTOR_SIZE) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct tree_t tree;
+    if (CollectTree(pvolume, &tree))return -1;
+
+    unsigned rootCount = pvolume->fatInfo.maximum_number_of_files;
+    size_t fatSize = FatBytes(pvolume);
+    uint32_t limit = tree.limit;
+    uint32_t clusterSectors = pvolume->fatInfo.sectors_per_clusters;
+    uint32_t bufferSectors = clusterSectors > DEFRAG_COPY_SECTORS ? clusterSectors : DEFRAG_COPY_SECTORS;
+
+    uint8_t *newFat = malloc(fatSize);
+    struct SFN *newRoot = malloc(sizeof(struct SFN) * rootCount);
+    uint8_t *used = calloc(limit, 1);
+    uint16_t *moved = calloc(limit, sizeof(uint16_t));
+    char *buffer = malloc((size_t) bufferSectors * SECTOR_SIZE);
+    int err = !newFat || !newRoot || !used || !moved || !buffer;
+    if (err)errno = ENOMEM;
+
+    //the tree's clusters are released, whatever is still allocated afterwards keeps its place
+    if (!err) {
+        memcpy(newFat, pvolume->FAT1, fatSize);
+        memcpy(newRoot, pvolume->rootDirectory, sizeof(struct SFN) * rootCount);
+        for (uint32_t cluster = 2; cluster < limit; cluster++) {
+            if (tree.claimed[cluster])AssignTableValue(cluster, 0, newFat);
+            used[cluster] = TableValue(cluster, newFat) != 0;
+        }
+    }
+
+    //new places, each chain takes the first free run long enough for it after the previous one
+    uint32_t cursor = 2;
+    for (size_t i = 0; !err && i < tree.count; i++) {
+        struct clusters_chain_t *chain = tree.objects[i].chain;
+        uint32_t previous = 0;
+        for (size_t j = 0; j < chain->size; j++) {
+            uint32_t cluster = FindRun(used, j ? previous + 1 : cursor, limit, j ? 1 : chain->size);
+            if (!cluster)cluster = FindRun(used, 2, limit, 1);
+            if (!cluster) {
+                errno = ENOSPC;
+                err = 1;
+                break;
+            }
+            used[cluster] = 1;
+            moved[chain->clusters[j]] = cluster;
+            if (j)AssignTableValue(previous, cluster, newFat);
+            previous = cluster;
+        }
+        if (!err)AssignTableValue(previous, FAT12_END_END, newFat);
+        if (previous >= cursor)cursor = previous + 1;
+    }
+
+    struct disk_t *in = pvolume->disk;
+    int out = -1;
+    if (!err) {
+        out = open(output_file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out == -1)err = 1;
+    }
+
+    //everything is copied as is first, then each chain is streamed to its new place
+    if (!err)err = CopySectors(in, out, 0, 0, pvolume->disk->numberOfSectors, buffer, bufferSectors);
+
+    ssize_t clusterBytes = (ssize_t) clusterSectors * SECTOR_SIZE;
+    for (size_t i = 0; !err && i < tree.count; i++) {
+        struct clusters_chain_t *chain = tree.objects[i].chain;
+        for (size_t j = 0; !err && j < chain->size; j++) {
+            off_t to = (off_t) fat_cluster_sector(pvolume, moved[chain->clusters[j]]) * SECTOR_SIZE;
+            if (disk_read(in, fat_cluster_sector(pvolume, chain->clusters[j]), buffer, (int32_t) clusterSectors) == -1) {
+                err = 1;
+                break;
+            }
+            if (tree.objects[i].is_directory)
+                PatchEntries((struct SFN *) buffer, clusterBytes / sizeof(struct SFN), moved, limit);
+            if (pwrite(out, buffer, clusterBytes, to) != clusterBytes)err = 1;
+        }
+    }
+
+    for (int i = 0; !err && i < pvolume->fatInfo.number_of_fats; i++) {
+        off_t offset = (off_t) (pvolume->fatInfo.size_of_reserved_area + i * pvolume->fatInfo.size_of_fat) * SECTOR_SIZE;
+        if (pwrite(out, newFat, fatSize, offset) != (ssize_t) fatSize)err = 1;
+    }
+    if (!err) {
+        PatchEntries(newRoot, rootCount, moved, limit);
+        off_t offset = (off_t) (pvolume->fatInfo.size_of_reserved_area +
+                                pvolume->fatInfo.number_of_fats * pvolume->fatInfo.size_of_fat) * SECTOR_SIZE;
+        ssize_t rootBytes = (ssize_t) (sizeof(struct SFN) * rootCount);
+        if (pwrite(out, newRoot, rootBytes, offset) != rootBytes)err = 1;
+    }
+    if (out != -1) {
+        if (close(out))err = 1;
+        if (err)unlink(output_file_name);
+    }
+
+    FreeTree(&tree);
+    free(moved);
+    free(used);
+    free(newRoot);
+    free(newFat);
+    free(buffer);
+
+    return err ? -1 : 0;
+}
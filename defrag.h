@@ -0,0 +1,35 @@
+#ifndef FAT_DEFRAG_H
+#define FAT_DEFRAG_H
+#include "file_reader.h"
+#include "tree_walk.h"
+
+#define DEFRAG_GAP_BUCKETS 12 //bucket i counts jumps of [2^i, 2^(i+1)) clusters, the last one everything above
+#define DEFRAG_PATH_LENGTH FAT_WALK_PATH_LENGTH
+
+struct fragmentation_file_t {
+    char path[DEFRAG_PATH_LENGTH];
+    int is_directory;
+    uint32_t clusters;
+    uint32_t extents; //runs of consecutive clusters
+};
+
+struct fragmentation_report_t {
+    struct fragmentation_file_t *files;
+    size_t fileCount;
+    uint32_t totalClusters;
+    uint32_t totalExtents;
+    uint32_t fragmentedFiles;
+    double averageRunLength; //clusters per extent over the whole volume
+    uint32_t gapHistogram[DEFRAG_GAP_BUCKETS];
+};
+
+struct fragmentation_report_t *fat_fragmentation(struct volume_t *pvolume);
+void fat_fragmentation_free(struct fragmentation_report_t *report);
+
+//Writes a copy of the volume's image to output_file_name with every file and directory of the tree stored
+//contiguously in directory order. Both FATs, the root directory and the first cluster fields inside moved
+//directories (including . and ..) are rewritten. Clusters no directory reaches stay where they are.
+//Data moves one cluster at a time, memory only grows with the cluster count of the FAT
+int fat_defragment(struct volume_t *pvolume, const char *output_file_name);
+
+#endif
@@ -0,0 +1,130 @@
+#include "dir_scan.h"
+
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SCAN_WIDTH 8
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define SCAN_WIDTH 4
+#else
+#define SCAN_WIDTH 1
+#endif
+
+#define ATTRIBUTE_VOLUME_LABEL (1 << 3)
+
+
+static int EntryInUse(const struct SFN *entry) {
+    if (entry->filename[0] == 0x0 || entry->filename[0] == (char) 0xe5)return 0;
+    return (entry->file_attributes & ATTRIBUTE_VOLUME_LABEL) == 0;
+}
+
+#if defined(__AVX2__)
+
+//Gathers dword 0 (first name byte) and dword 2 (attribute in the top byte) of 8 entries,
+//one bit per entry that is in use, end gets one bit per end-of-directory marker
+static unsigned ScanBlock(const struct SFN *entries, unsigned *end) {
+    const __m256i firstIndex = _mm256_setr_epi32(0, 8, 16, 24, 32, 40, 48, 56);
+    const __m256i attributeIndex = _mm256_setr_epi32(2, 10, 18, 26, 34, 42, 50, 58);
+    const char *bytes = entries->filename;
+    const int *base = (const void *) bytes;
+    __m256i first = _mm256_i32gather_epi32(base, firstIndex, 4);
+    __m256i attributes = _mm256_i32gather_epi32(base, attributeIndex, 4);
+
+    first = _mm256_and_si256(first, _mm256_set1_epi32(0xff));
+    attributes = _mm256_and_si256(attributes, _mm256_set1_epi32(ATTRIBUTE_VOLUME_LABEL << 24));
+
+    __m256i marker = _mm256_cmpeq_epi32(first, _mm256_setzero_si256());
+    __m256i unused = _mm256_or_si256(marker, _mm256_cmpeq_epi32(first, _mm256_set1_epi32(0xe5)));
+    __m256i notLabel = _mm256_cmpeq_epi32(attributes, _mm256_setzero_si256());
+
+    *end = (unsigned) _mm256_movemask_ps(_mm256_castsi256_ps(marker));
+
+    return (unsigned) _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_andnot_si256(unused, notLabel)));
+}
+
+#elif defined(__SSE2__)
+
+//Transposes dword 0 (first name byte) and dword 2 (attribute in the top byte) of 4 entries,
+//one bit per entry that is in use, end gets one bit per end-of-directory marker
+static unsigned ScanBlock(const struct SFN *entries, unsigned *end) {
+    __m128i a = _mm_loadu_si128((const __m128i *) (entries + 0));
+    __m128i b = _mm_loadu_si128((const __m128i *) (entries + 1));
+    __m128i c = _mm_loadu_si128((const __m128i *) (entries + 2));
+    __m128i d = _mm_loadu_si128((const __m128i *) (entries + 3));
+
+    __m128i first = _mm_unpacklo_epi64(_mm_unpacklo_epi32(a, b), _mm_unpacklo_epi32(c, d));
+    __m128i attributes = _mm_unpacklo_epi64(_mm_unpackhi_epi32(a, b), _mm_unpackhi_epi32(c, d));
+
+    first = _mm_and_si128(first, _mm_set1_epi32(0xff));
+    attributes = _mm_and_si128(attributes, _mm_set1_epi32(ATTRIBUTE_VOLUME_LABEL << 24));
+
+    __m128i marker = _mm_cmpeq_epi32(first, _mm_setzero_si128());
+    __m128i unused = _mm_or_si128(marker, _mm_cmpeq_epi32(first, _mm_set1_epi32(0xe5)));
+    __m128i notLabel = _mm_cmpeq_epi32(attributes, _mm_setzero_si128());
+
+    *end = (unsigned) _mm_movemask_ps(_mm_castsi128_ps(marker));
+
+    return (unsigned) _mm_movemask_ps(_mm_castsi128_ps(_mm_andnot_si128(unused, notLabel)));
+}
+
+#else
+
+static unsigned ScanBlock(const struct SFN *entries, unsigned *end) {
+    *end = entries->filename[0] == 0x0;
+    return (unsigned) EntryInUse(entries);
+}
+
+#endif
+
+
+int dir_scan_next(const struct SFN *entries, int pos, int count) {
+    if (!entries || pos < 0)return count;
+
+    for (; pos + SCAN_WIDTH <= count; pos += SCAN_WIDTH) {
+        unsigned end;
+        unsigned mask = ScanBlock(entries + pos, &end);
+        if (mask | end) {
+            int first = __builtin_ctz(mask | end);
+            return (end >> first) & 1 ? count : pos + first;
+        }
+    }
+    for (; pos < count; pos++) {
+        if (entries[pos].filename[0] == 0x0)return count;
+        if (EntryInUse(entries + pos))return pos;
+    }
+
+    return count;
+}
+
+int dir_scan_find(const struct SFN *entries, int count, const char *name) {
+    if (!entries || !name)return -1;
+
+    int i = 0;
+#if defined(__SSE2__)
+    char padded[16] = {0};
+    memcpy(padded, name, 11);
+    const __m128i target = _mm_loadu_si128((const __m128i *) padded);
+#if defined(__AVX2__)
+    const __m256i target2 = _mm256_broadcastsi128_si256(target);
+    for (; i + 2 <= count; i += 2) {
+        __m256i pair = _mm256_loadu2_m128i((const __m128i *) (entries + i + 1), (const __m128i *) (entries + i));
+        unsigned mask = (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(pair, target2));
+        if ((mask & 0x7ff) == 0x7ff)return i;
+        if ((mask & 0x7ff0000) == 0x7ff0000)return i + 1;
+    }
+#endif
+    for (; i < count; i++) {
+        __m128i entry = _mm_loadu_si128((const __m128i *) (entries + i));
+        unsigned mask = (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(entry, target));
+        if ((mask & 0x7ff) == 0x7ff)return i;
+    }
+#else
+    for (; i < count; i++) {
+        if (memcmp(entries[i].filename, name, 11) == 0)return i;
+    }
+#endif
+
+    return -1;
+}
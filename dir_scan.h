@@ -0,0 +1,14 @@
+#ifndef FAT_DIR_SCAN_H
+#define FAT_DIR_SCAN_H
+#include "FatStructures.h"
+
+//Directory entry scanning kernels, AVX2 or SSE2 when the compiler targets them, scalar otherwise
+
+//Index of the first entry at or after pos that is in use (not free, not deleted) and is not a volume label,
+//count when there is none. A free entry (first byte 0x00) ends the directory, nothing after it is in use
+int dir_scan_next(const struct SFN *entries, int pos, int count);
+
+//Index of the first entry whose 11 byte name equals name, -1 when there is none
+int dir_scan_find(const struct SFN *entries, int count, const char *name);
+
+#endif
@@ -0,0 +1,417 @@
+#include "disk_compressed.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 65535
+
+
+//Sequences are a token (literal length << 4 | match length - 4, 15 meaning more length bytes follow),
+//the literals, a 16 bit offset and the match. The last sequence has literals only
+static size_t PutLength(uint8_t *dest, size_t op, size_t capacity, size_t length) {
+    for (length -= 15; length >= 255; length -= 255) {
+        if (op >= capacity)return 0;
+        dest[op++] = 255;
+    }
+    if (op >= capacity)return 0;
+    dest[op++] = (uint8_t) length;
+    return op;
+}
+
+static size_t PutSequence(uint8_t *dest, size_t op, size_t capacity, const uint8_t *literals, size_t literalLength,
+                          size_t offset, size_t matchLength) {
+    if (op >= capacity)return 0;
+    size_t token = op++;
+    dest[token] = (uint8_t) ((literalLength < 15 ? literalLength : 15) << 4);
+    if (literalLength >= 15 && !(op = PutLength(dest, op, capacity, literalLength)))return 0;
+    if (op + literalLength > capacity)return 0;
+    memcpy(dest + op, literals, literalLength);
+    op += literalLength;
+    if (!matchLength)return op;
+
+    if (op + 2 > capacity)return 0;
+    dest[op++] = (uint8_t) offset;
+    dest[op++] = (uint8_t) (offset >> 8);
+    size_t extra = matchLength - LZ_MIN_MATCH;
+    dest[token] |= (uint8_t) (extra < 15 ? extra : 15);
+    if (extra >= 15 && !(op = PutLength(dest, op, capacity, extra)))return 0;
+    return op;
+}
+
+static uint32_t Read32(const uint8_t *bytes) {
+    uint32_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+size_t lz_compress(const uint8_t *source, size_t size, uint8_t *dest, size_t capacity) {
+    uint32_t table[1 << LZ_HASH_BITS] = {0}; //position + 1 of the last sequence with that hash
+    size_t ip = 0, anchor = 0, op = 0;
+
+    while (ip + LZ_MIN_MATCH <= size) {
+        uint32_t sequence = Read32(source + ip);
+        uint32_t hash = (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+        size_t candidate = table[hash];
+        table[hash] = (uint32_t) (ip + 1);
+
+        if (!candidate || ip - (candidate - 1) > LZ_MAX_OFFSET || Read32(source + candidate - 1) != sequence) {
+            ip++;
+            continue;
+        }
+
+        size_t reference = candidate - 1;
+        size_t length = LZ_MIN_MATCH;
+        while (ip + length < size && source[reference + length] == source[ip + length])length++;
+
+        op = PutSequence(dest, op, capacity, source + anchor, ip - anchor, ip - reference, length);
+        if (!op)return 0;
+        ip += length;
+        anchor = ip;
+    }
+
+    return PutSequence(dest, op, capacity, source + anchor, size - anchor, 0, 0);
+}
+
+static int GetLength(const uint8_t *source, size_t size, size_t *ip, size_t *length) {
+    uint8_t byte;
+    do {
+        if (*ip >= size)return 1;
+        byte = source[(*ip)++];
+        *length += byte;
+    } while (byte == 255);
+    return 0;
+}
+
+size_t lz_decompress(const uint8_t *source, size_t size, uint8_t *dest, size_t capacity) {
+    size_t ip = 0, op = 0;
+
+    while (ip < size) {
+        uint8_t token = source[ip++];
+        size_t literalLength = token >> 4;
+        if (literalLength == 15 && GetLength(source, size, &ip, &literalLength))return 0;
+        if (literalLength > size - ip || literalLength > capacity - op)return 0;
+        memcpy(dest + op, source + ip, literalLength);
+        ip += literalLength;
+        op += literalLength;
+        if (ip == size)break;
+
+        if (size - ip < 2)return 0;
+        size_t offset = source[ip] | (size_t) source[ip + 1] << 8;
+        ip += 2;
+        size_t matchLength = token & 15;
+        if (matchLength == 15 && GetLength(source, size, &ip, &matchLength))return 0;
+        matchLength += LZ_MIN_MATCH;
+        if (!offset || offset > op || matchLength > capacity - op)return 0;
+
+        //byte by byte, the match may overlap what it is producing
+        for (size_t i = 0; i < matchLength; i++, op++)dest[op] = dest[op - offset];
+    }
+
+    return op;
+}
+
+
+struct chunk_cache_entry_t {
+    int64_t chunk;
+    uint64_t lastUse;
+    int pins; //readers copying out of data, plus the loader while loading
+    int loading; //data is being filled outside the lock
+    uint8_t *data;
+    uint8_t *stored; //compressed bytes of the chunk being loaded
+};
+
+struct compressed_t {
+    uint64_t imageSize;
+    uint32_t chunkSize;
+    uint32_t chunkCount;
+    struct disk_chunk_t *index;
+    pthread_mutex_t lock; //guards the slots' bookkeeping, never held across I/O or decompression
+    pthread_cond_t changed; //a slot finished loading or lost its last pin
+    uint64_t tick;
+    struct chunk_cache_entry_t cache[DISK_COMPRESSED_CACHE_CHUNKS];
+};
+
+static size_t ChunkLength(const struct compressed_t *container, uint32_t chunk) {
+    uint64_t start = (uint64_t) chunk * container->chunkSize;
+    uint64_t left = container->imageSize - start;
+    return left < container->chunkSize ? (size_t) left : container->chunkSize;
+}
+
+static int LoadChunk(struct disk_t *pdisk, uint32_t chunk, struct chunk_cache_entry_t *slot) {
+    struct compressed_t *container = pdisk->backend;
+    const struct disk_chunk_t *entry = container->index + chunk;
+    size_t length = ChunkLength(container, chunk);
+    if (entry->type == DISK_CHUNK_RAW) {
+        if (entry->stored_size != length) {
+            errno = EIO;
+            return -1;
+        }
+        return disk_pread(pdisk->diskFD, slot->data, length, (off_t) entry->offset) ? -1 : 0;
+    }
+    if (disk_pread(pdisk->diskFD, slot->stored, entry->stored_size, (off_t) entry->offset))return -1;
+    if (lz_decompress(slot->stored, entry->stored_size, slot->data, length) != length) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+//Slot holding the decompressed chunk, pinned until UnpinChunk. On a miss the least recently used unpinned
+//slot is claimed under the lock and filled outside it, so readers of other chunks are not held up
+static struct chunk_cache_entry_t *PinChunk(struct disk_t *pdisk, uint32_t chunk) {
+    struct compressed_t *container = pdisk->backend;
+    pthread_mutex_lock(&container->lock);
+    while (1) {
+        struct chunk_cache_entry_t *hit = NULL, *victim = NULL;
+        for (int i = 0; i < DISK_COMPRESSED_CACHE_CHUNKS && !hit; i++) {
+            struct chunk_cache_entry_t *slot = container->cache + i;
+            if (slot->chunk == chunk)hit = slot;
+            else if (!slot->pins && (!victim || slot->lastUse < victim->lastUse))victim = slot;
+        }
+        if (hit && !hit->loading) {
+            hit->pins++;
+            hit->lastUse = ++container->tick;
+            pthread_mutex_unlock(&container->lock);
+            return hit;
+        }
+        if (hit || !victim) {
+            pthread_cond_wait(&container->changed, &container->lock);
+            continue;
+        }
+
+        victim->chunk = chunk;
+        victim->lastUse = ++container->tick;
+        victim->pins = 1;
+        victim->loading = 1;
+        pthread_mutex_unlock(&container->lock);
+
+        int err = LoadChunk(pdisk, chunk, victim);
+        int savedErrno = errno;
+
+        pthread_mutex_lock(&container->lock);
+        victim->loading = 0;
+        if (err) {
+            victim->chunk = -1;
+            victim->pins = 0;
+        }
+        pthread_cond_broadcast(&container->changed);
+        pthread_mutex_unlock(&container->lock);
+        if (err) {
+            errno = savedErrno;
+            return NULL;
+        }
+        return victim;
+    }
+}
+
+static void UnpinChunk(struct compressed_t *container, struct chunk_cache_entry_t *slot) {
+    pthread_mutex_lock(&container->lock);
+    if (!--slot->pins)pthread_cond_broadcast(&container->changed);
+    pthread_mutex_unlock(&container->lock);
+}
+
+static int CompressedRead(struct disk_t *pdisk, int32_t first_sector, void *buffer, int32_t sectors_to_read) {
+    struct compressed_t *container = pdisk->backend;
+    uint64_t position = (uint64_t) first_sector * SECTOR_SIZE;
+    size_t left = (size_t) sectors_to_read * SECTOR_SIZE;
+    char *dest = buffer;
+
+    while (left) {
+        uint32_t chunk = (uint32_t) (position / container->chunkSize);
+        size_t offset = (size_t) (position % container->chunkSize);
+        size_t bytes = ChunkLength(container, chunk) - offset;
+        if (bytes > left)bytes = left;
+
+        if (container->index[chunk].type == DISK_CHUNK_HOLE) {
+            memset(dest, 0, bytes);
+        } else {
+            struct chunk_cache_entry_t *slot = PinChunk(pdisk, chunk);
+            if (!slot)return -1;
+            memcpy(dest, slot->data + offset, bytes);
+            UnpinChunk(container, slot);
+        }
+
+        dest += bytes;
+        position += bytes;
+        left -= bytes;
+    }
+
+    return sectors_to_read;
+}
+
+static void FreeContainer(struct compressed_t *container) {
+    for (int i = 0; i < DISK_COMPRESSED_CACHE_CHUNKS; i++) {
+        free(container->cache[i].data);
+        free(container->cache[i].stored);
+    }
+    free(container->index);
+    free(container);
+}
+
+static void CompressedClose(struct disk_t *pdisk) {
+    struct compressed_t *container = pdisk->backend;
+    pthread_cond_destroy(&container->changed);
+    pthread_mutex_destroy(&container->lock);
+    FreeContainer(container);
+}
+
+static const struct disk_ops_t compressedOps = {CompressedRead, NULL, CompressedClose};
+
+
+struct disk_t *disk_open_compressed(const char *container_file_name) {
+    if (!container_file_name) {
+        errno = EFAULT;
+        return NULL;
+    }
+
+    struct disk_t *result = malloc(sizeof(struct disk_t));
+    struct compressed_t *container = calloc(1, sizeof(struct compressed_t));
+    if (!result || !container) {
+        free(result);
+        free(container);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    result->diskFD = open(container_file_name, O_RDONLY);
+    if (result->diskFD == -1) {
+        free(result);
+        free(container);
+        return NULL;
+    }
+
+    struct disk_compressed_header_t header;
+    struct stat info;
+    int err = fstat(result->diskFD, &info) || disk_pread(result->diskFD, &header, sizeof(header), 0);
+    if (!err) {
+        err = memcmp(header.magic, DISK_COMPRESSED_MAGIC, sizeof(header.magic)) ||
+              header.version != DISK_COMPRESSED_VERSION || header.chunk_size < SECTOR_SIZE ||
+              header.chunk_size > (1 << 24) ||
+              header.chunk_count != (header.image_size + header.chunk_size - 1) / header.chunk_size ||
+              header.index_offset + (uint64_t) header.chunk_count * sizeof(struct disk_chunk_t) > (uint64_t) info.st_size;
+        if (err)errno = EINVAL;
+    }
+
+    if (!err) {
+        container->imageSize = header.image_size;
+        container->chunkSize = header.chunk_size;
+        container->chunkCount = header.chunk_count;
+        container->index = malloc(sizeof(struct disk_chunk_t) * (header.chunk_count + 1));
+        err = !container->index;
+        for (int i = 0; !err && i < DISK_COMPRESSED_CACHE_CHUNKS; i++) {
+            container->cache[i].chunk = -1;
+            container->cache[i].data = malloc(header.chunk_size);
+            container->cache[i].stored = malloc(header.chunk_size);
+            err = !container->cache[i].data || !container->cache[i].stored;
+        }
+        if (err)errno = ENOMEM;
+    }
+    if (!err) {
+        err = disk_pread(result->diskFD, container->index, sizeof(struct disk_chunk_t) * header.chunk_count,
+                         (off_t) header.index_offset) != 0;
+    }
+    for (uint32_t i = 0; !err && i < header.chunk_count; i++) {
+        const struct disk_chunk_t *entry = container->index + i;
+        err = entry->type > DISK_CHUNK_LZ || entry->stored_size > header.chunk_size ||
+              entry->offset + entry->stored_size > (uint64_t) info.st_size;
+        if (err)errno = EINVAL;
+    }
+    if (!err)err = pthread_mutex_init(&container->lock, NULL) != 0;
+    if (!err && pthread_cond_init(&container->changed, NULL)) {
+        pthread_mutex_destroy(&container->lock);
+        err = 1;
+    }
+
+    if (err) {
+        int savedErrno = errno;
+        close(result->diskFD);
+        FreeContainer(container);
+        free(result);
+        errno = savedErrno;
+        return NULL;
+    }
+
+    result->numberOfSectors = (uint32_t) (header.image_size / SECTOR_SIZE);
+    result->ops = &compressedOps;
+    result->backend = container;
+    return result;
+}
+
+int disk_compress_image(const char *image_file_name, const char *container_file_name) {
+    if (!image_file_name || !container_file_name) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    int in = open(image_file_name, O_RDONLY);
+    if (in == -1)return -1;
+    struct stat info;
+    if (fstat(in, &info)) {
+        close(in);
+        return -1;
+    }
+
+    struct disk_compressed_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DISK_COMPRESSED_MAGIC, sizeof(header.magic));
+    header.version = DISK_COMPRESSED_VERSION;
+    header.chunk_size = DISK_COMPRESSED_CHUNK_SIZE;
+    header.image_size = info.st_size;
+    header.chunk_count = (uint32_t) ((header.image_size + header.chunk_size - 1) / header.chunk_size);
+
+    uint8_t *chunk = malloc(header.chunk_size);
+    uint8_t *packed = malloc(header.chunk_size);
+    struct disk_chunk_t *index = calloc(header.chunk_count + 1, sizeof(struct disk_chunk_t));
+    FILE *out = fopen(container_file_name, "wb");
+    int err = !chunk || !packed || !index || !out;
+    if (err && (!chunk || !packed || !index))errno = ENOMEM;
+
+    uint64_t offset = sizeof(header);
+    if (!err)err = fwrite(&header, sizeof(header), 1, out) != 1;
+
+    for (uint32_t i = 0; !err && i < header.chunk_count; i++) {
+        uint64_t left = header.image_size - (uint64_t) i * header.chunk_size;
+        size_t length = left < header.chunk_size ? (size_t) left : header.chunk_size;
+        if (disk_pread(in, chunk, length, (off_t) i * header.chunk_size)) {
+            err = 1;
+            break;
+        }
+
+        size_t zero = 0;
+        while (zero < length && !chunk[zero])zero++;
+        index[i].offset = offset;
+        if (zero == length) {
+            index[i].type = DISK_CHUNK_HOLE;
+            continue;
+        }
+
+        size_t packedSize = lz_compress(chunk, length, packed, length - 1);
+        const uint8_t *stored = packedSize ? packed : chunk;
+        index[i].type = packedSize ? DISK_CHUNK_LZ : DISK_CHUNK_RAW;
+        index[i].stored_size = (uint32_t) (packedSize ? packedSize : length);
+        err = fwrite(stored, index[i].stored_size, 1, out) != 1;
+        offset += index[i].stored_size;
+    }
+
+    header.index_offset = offset;
+    if (!err) {
+        err = fwrite(index, sizeof(struct disk_chunk_t), header.chunk_count, out) != header.chunk_count ||
+              fseek(out, 0, SEEK_SET) || fwrite(&header, sizeof(header), 1, out) != 1;
+    }
+    if (out && fclose(out))err = 1;
+    if (err && out)remove(container_file_name);
+
+    free(chunk);
+    free(packed);
+    free(index);
+    close(in);
+
+    return err ? -1 : 0;
+}
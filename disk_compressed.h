@@ -0,0 +1,39 @@
+#ifndef FAT_DISK_COMPRESSED_H
+#define FAT_DISK_COMPRESSED_H
+#include "file_reader.h"
+
+#define DISK_COMPRESSED_MAGIC "FATLZ001"
+#define DISK_COMPRESSED_VERSION 1
+#define DISK_COMPRESSED_CHUNK_SIZE 65536
+#define DISK_COMPRESSED_CACHE_CHUNKS 8
+
+#define DISK_CHUNK_HOLE 0 //all zero, nothing stored
+#define DISK_CHUNK_RAW 1 //stored as is, compression did not pay off
+#define DISK_CHUNK_LZ 2
+
+//Container: header, chunk data, then chunk_count index entries at index_offset
+struct __attribute__((__packed__)) disk_compressed_header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t chunk_size;
+    uint64_t image_size;
+    uint32_t chunk_count;
+    uint64_t index_offset;
+};
+
+struct __attribute__((__packed__)) disk_chunk_t {
+    uint64_t offset;
+    uint32_t stored_size;
+    uint32_t type;
+};
+
+//Read-only disk over a container, disk_read decompresses only the chunks it touches through a small cache
+struct disk_t *disk_open_compressed(const char *container_file_name);
+//Converts a raw image such as fat12test.img into a container
+int disk_compress_image(const char *image_file_name, const char *container_file_name);
+
+//LZ77 block codec used for the chunks, 0 when the output does not fit
+size_t lz_compress(const uint8_t *source, size_t size, uint8_t *dest, size_t capacity);
+size_t lz_decompress(const uint8_t *source, size_t size, uint8_t *dest, size_t capacity);
+
+#endif
@@ -0,0 +1,236 @@
+#define _GNU_SOURCE
+#include "disk_direct.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+
+struct direct_t {
+    int direct; //O_DIRECT still set on diskFD
+    uint32_t alignment; //file offset, length and memory alignment of direct reads
+    uint64_t size;
+    pthread_mutex_t lock; //guards the pool
+    pthread_cond_t returned;
+    void *buffers[DISK_DIRECT_BUFFERS]; //allocated on first use
+    int busy[DISK_DIRECT_BUFFERS];
+};
+
+static uint32_t DirectAlignment(int fd) {
+    uint32_t result = 0;
+#ifdef STATX_DIOALIGN
+    struct statx info;
+    if (!statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &info) && (info.stx_mask & STATX_DIOALIGN)) {
+        result = info.stx_dio_offset_align > info.stx_dio_mem_align ? info.stx_dio_offset_align : info.stx_dio_mem_align;
+    }
+#endif
+    struct stat device;
+    int sectorSize;
+    if (!result && !fstat(fd, &device) && S_ISBLK(device.st_mode) && !ioctl(fd, BLKSSZGET, &sectorSize) && sectorSize > 0)
+        result = (uint32_t) sectorSize;
+
+    if (!result || (result & (result - 1)) || result > DISK_DIRECT_BUFFER_SIZE)result = DISK_DIRECT_DEFAULT_ALIGNMENT;
+    return result < SECTOR_SIZE ? SECTOR_SIZE : result;
+}
+
+static int TakeBuffer(struct direct_t *direct) {
+    pthread_mutex_lock(&direct->lock);
+    while (1) {
+        for (int i = 0; i < DISK_DIRECT_BUFFERS; i++) {
+            if (direct->busy[i])continue;
+            if (!direct->buffers[i] && posix_memalign(direct->buffers + i, direct->alignment, DISK_DIRECT_BUFFER_SIZE)) {
+                direct->buffers[i] = NULL;
+                continue;
+            }
+            direct->busy[i] = 1;
+            pthread_mutex_unlock(&direct->lock);
+            return i;
+        }
+        int any = 0;
+        for (int i = 0; i < DISK_DIRECT_BUFFERS; i++)any |= direct->busy[i];
+        if (!any) {
+            pthread_mutex_unlock(&direct->lock);
+            errno = ENOMEM;
+            return -1;
+        }
+        pthread_cond_wait(&direct->returned, &direct->lock);
+    }
+}
+
+static void ReturnBuffer(struct direct_t *direct, int buffer) {
+    pthread_mutex_lock(&direct->lock);
+    direct->busy[buffer] = 0;
+    pthread_cond_signal(&direct->returned);
+    pthread_mutex_unlock(&direct->lock);
+}
+
+//At least minimum of size bytes. Once a read comes back short it is the end of the file, and another read
+//would start at an unaligned offset, so the loop ends as soon as minimum is there
+static int ReadAtLeast(int fd, char *buffer, size_t size, size_t minimum, off_t offset) {
+    size_t done = 0;
+    while (done < minimum) {
+        ssize_t count = pread(fd, buffer + done, size - done, offset + (off_t) done);
+        if (count == -1) {
+            if (errno == EINTR)continue;
+            return -1;
+        }
+        if (count == 0)break;
+        done += count;
+    }
+    if (done < minimum) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+//First EINVAL from a direct read means the filesystem takes O_DIRECT at open but not at read time
+static void FallBack(struct disk_t *pdisk) {
+    struct direct_t *direct = pdisk->backend;
+    int flags = fcntl(pdisk->diskFD, F_GETFL);
+    if (flags != -1)fcntl(pdisk->diskFD, F_SETFL, flags & ~O_DIRECT);
+    __atomic_store_n(&direct->direct, 0, __ATOMIC_RELAXED);
+}
+
+static int BufferedRead(struct disk_t *pdisk, off_t position, char *dest, size_t length) {
+    if (disk_pread(pdisk->diskFD, dest, length, position))return -1;
+    //read once and let go, the point of this backend is to leave the page cache to others
+    posix_fadvise(pdisk->diskFD, position, (off_t) length, POSIX_FADV_DONTNEED);
+    return 0;
+}
+
+static int DirectRead(struct disk_t *pdisk, int32_t first_sector, void *buffer, int32_t sectors_to_read) {
+    struct direct_t *direct = pdisk->backend;
+    uint64_t position = (uint64_t) first_sector * SECTOR_SIZE;
+    size_t left = (size_t) sectors_to_read * SECTOR_SIZE;
+    char *dest = buffer;
+    uint32_t alignment = direct->alignment;
+
+    if (!__atomic_load_n(&direct->direct, __ATOMIC_RELAXED))
+        return BufferedRead(pdisk, (off_t) position, dest, left) ? -1 : sectors_to_read;
+
+    //already aligned: straight into the caller's buffer, no copy
+    if (position % alignment == 0 && left % alignment == 0 && (uintptr_t) dest % alignment == 0) {
+        if (!ReadAtLeast(pdisk->diskFD, dest, left, left, (off_t) position))return sectors_to_read;
+        if (errno != EINVAL)return -1;
+        FallBack(pdisk);
+        return BufferedRead(pdisk, (off_t) position, dest, left) ? -1 : sectors_to_read;
+    }
+
+    int slot = TakeBuffer(direct);
+    if (slot == -1)return -1;
+    char *bounce = direct->buffers[slot];
+
+    while (left) {
+        uint64_t start = position / alignment * alignment;
+        size_t skip = (size_t) (position - start);
+        size_t span = (skip + left + alignment - 1) / alignment * alignment;
+        if (span > DISK_DIRECT_BUFFER_SIZE)span = DISK_DIRECT_BUFFER_SIZE;
+        size_t bytes = span - skip < left ? span - skip : left;
+
+        if (ReadAtLeast(pdisk->diskFD, bounce, span, skip + bytes, (off_t) start)) {
+            if (errno != EINVAL) {
+                ReturnBuffer(direct, slot);
+                return -1;
+            }
+            FallBack(pdisk);
+            ReturnBuffer(direct, slot);
+            return BufferedRead(pdisk, (off_t) position, dest, left) ? -1 : sectors_to_read;
+        }
+        memcpy(dest, bounce + skip, bytes);
+
+        dest += bytes;
+        position += bytes;
+        left -= bytes;
+    }
+
+    ReturnBuffer(direct, slot);
+    return sectors_to_read;
+}
+
+static void FreeDirect(struct direct_t *direct) {
+    for (int i = 0; i < DISK_DIRECT_BUFFERS; i++)free(direct->buffers[i]);
+    free(direct);
+}
+
+static void DirectClose(struct disk_t *pdisk) {
+    struct direct_t *direct = pdisk->backend;
+    pthread_cond_destroy(&direct->returned);
+    pthread_mutex_destroy(&direct->lock);
+    FreeDirect(direct);
+}
+
+static const struct disk_ops_t directOps = {DirectRead, NULL, DirectClose};
+
+
+struct disk_t *disk_open_direct(const char *volume_file_name) {
+    if (!volume_file_name) {
+        errno = EFAULT;
+        return NULL;
+    }
+
+    struct disk_t *result = malloc(sizeof(struct disk_t));
+    struct direct_t *direct = calloc(1, sizeof(struct direct_t));
+    if (!result || !direct) {
+        free(result);
+        free(direct);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    direct->direct = 1;
+    result->diskFD = open(volume_file_name, O_RDONLY | O_DIRECT);
+    if (result->diskFD == -1 && errno == EINVAL) {
+        direct->direct = 0;
+        result->diskFD = open(volume_file_name, O_RDONLY);
+    }
+    if (result->diskFD == -1) {
+        int savedErrno = errno;
+        free(result);
+        free(direct);
+        errno = savedErrno;
+        return NULL;
+    }
+
+    struct stat info;
+    int err = fstat(result->diskFD, &info);
+    if (!err) {
+        direct->size = (uint64_t) info.st_size;
+        uint64_t deviceSize;
+        if (S_ISBLK(info.st_mode) && !ioctl(result->diskFD, BLKGETSIZE64, &deviceSize))direct->size = deviceSize;
+        direct->alignment = DirectAlignment(result->diskFD);
+        err = pthread_mutex_init(&direct->lock, NULL) != 0;
+        if (!err && pthread_cond_init(&direct->returned, NULL)) {
+            pthread_mutex_destroy(&direct->lock);
+            err = 1;
+        }
+    }
+    if (err) {
+        int savedErrno = errno;
+        close(result->diskFD);
+        free(direct);
+        free(result);
+        errno = savedErrno;
+        return NULL;
+    }
+
+    result->numberOfSectors = (uint32_t) (direct->size / SECTOR_SIZE);
+    result->ops = &directOps;
+    result->backend = direct;
+    return result;
+}
+
+int disk_direct_active(const struct disk_t *pdisk) {
+    if (!pdisk || pdisk->ops != &directOps) {
+        errno = EINVAL;
+        return -1;
+    }
+    const struct direct_t *direct = pdisk->backend;
+    return __atomic_load_n(&direct->direct, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,19 @@
+#ifndef FAT_DISK_DIRECT_H
+#define FAT_DISK_DIRECT_H
+#include "file_reader.h"
+
+#define DISK_DIRECT_BUFFER_SIZE (1 << 20)
+#define DISK_DIRECT_BUFFERS 8
+#define DISK_DIRECT_DEFAULT_ALIGNMENT 4096 //when the kernel does not report one
+
+//Read-only disk over an image opened with O_DIRECT, so bulk reads bypass the page cache.
+//Reads whose offset, length and buffer meet the device alignment go straight into the caller's buffer,
+//the rest are widened to aligned ranges and copied out of a pool of reusable aligned buffers.
+//Filesystems without direct I/O (tmpfs, some FUSE and network mounts) fall back to buffered reads that
+//drop what they read from the page cache afterwards
+struct disk_t *disk_open_direct(const char *volume_file_name);
+
+//1 while reads bypass the page cache, 0 after the fallback, -1 for a disk not opened by disk_open_direct
+int disk_direct_active(const struct disk_t *pdisk);
+
+#endif
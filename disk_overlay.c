@@ -0,0 +1,198 @@
+#include "disk_overlay.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define OVERLAY_ALIGNMENT 4096
+
+
+struct overlay_t {
+    int fd;
+    const char *base;
+    size_t baseSize;
+    uint8_t *bitmap;
+    size_t bitmapSize;
+    off_t dataOffset;
+};
+
+static int SectorWritten(const struct overlay_t *overlay, uint32_t sector) {
+    return (__atomic_load_n(overlay->bitmap + sector / 8, __ATOMIC_ACQUIRE) >> (sector % 8)) & 1;
+}
+
+static int OverlayRead(struct disk_t *pdisk, int32_t first_sector, void *buffer, int32_t sectors_to_read) {
+    struct overlay_t *overlay = pdisk->backend;
+    char *dest = buffer;
+    uint32_t sector = first_sector, end = first_sector + sectors_to_read;
+
+    //runs of sectors that come from the same side are copied in one go
+    while (sector < end) {
+        int written = SectorWritten(overlay, sector);
+        uint32_t run = 1;
+        while (sector + run < end && SectorWritten(overlay, sector + run) == written)run++;
+
+        size_t bytes = (size_t) run * SECTOR_SIZE;
+        if (written) {
+            if (disk_pread(overlay->fd, dest, bytes, overlay->dataOffset + (off_t) sector * SECTOR_SIZE))return -1;
+        } else {
+            memcpy(dest, overlay->base + (size_t) sector * SECTOR_SIZE, bytes);
+        }
+        dest += bytes;
+        sector += run;
+    }
+
+    return sectors_to_read;
+}
+
+static int OverlayWrite(struct disk_t *pdisk, int32_t first_sector, const void *buffer, int32_t sectors_to_write) {
+    struct overlay_t *overlay = pdisk->backend;
+    const char *source = buffer;
+    size_t left = (size_t) sectors_to_write * SECTOR_SIZE;
+    off_t offset = overlay->dataOffset + (off_t) first_sector * SECTOR_SIZE;
+
+    while (left) {
+        ssize_t count = pwrite(overlay->fd, source, left, offset);
+        if (count <= 0) {
+            if (count == -1 && errno == EINTR)continue;
+            return -1;
+        }
+        source += count;
+        offset += count;
+        left -= count;
+    }
+
+    //a sector's first write reaches the disk before its bit, after a crash a set bit never points at a hole
+    int first = 0;
+    for (int32_t i = 0; !first && i < sectors_to_write; i++)first = !SectorWritten(overlay, first_sector + i);
+    if (first && fdatasync(overlay->fd))return -1;
+
+    //bits go up only after the data is in place, a concurrent reader sees either the old or the new sector
+    for (int32_t i = 0; i < sectors_to_write; i++) {
+        uint32_t sector = first_sector + i;
+        __atomic_fetch_or(overlay->bitmap + sector / 8, (uint8_t) (1 << (sector % 8)), __ATOMIC_RELEASE);
+    }
+
+    return sectors_to_write;
+}
+
+static void OverlayClose(struct disk_t *pdisk) {
+    struct overlay_t *overlay = pdisk->backend;
+    munmap((void *) overlay->base, overlay->baseSize);
+    munmap(overlay->bitmap, overlay->bitmapSize);
+    close(overlay->fd);
+    free(overlay);
+}
+
+static const struct disk_ops_t overlayOps = {OverlayRead, OverlayWrite, OverlayClose};
+
+
+//The overlay is built under a temporary name and linked into place whole, so whoever opens
+//overlay_file_name sees a complete header. Returns the open file, -1 with errno EEXIST when another
+//process linked its own first
+static int CreateOverlay(const char *overlay_file_name, const struct disk_overlay_header_t *header) {
+    size_t length = strlen(overlay_file_name);
+    char *tempName = malloc(length + 8);
+    if (!tempName) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(tempName, overlay_file_name, length);
+    memcpy(tempName + length, ".XXXXXX", 8);
+
+    int fd = mkstemp(tempName);
+    if (fd == -1) {
+        free(tempName);
+        return -1;
+    }
+    off_t size = (off_t) header->data_offset + (off_t) header->number_of_sectors * SECTOR_SIZE;
+    int err = fchmod(fd, 0644) || pwrite(fd, header, sizeof(*header), 0) != sizeof(*header) || ftruncate(fd, size) ||
+              fdatasync(fd) || link(tempName, overlay_file_name);
+    int savedErrno = errno;
+    unlink(tempName);
+    free(tempName);
+    if (err) {
+        close(fd);
+        errno = savedErrno;
+        return -1;
+    }
+    return fd;
+}
+
+struct disk_t *disk_open_overlay(const char *base_file_name, const char *overlay_file_name) {
+    if (!base_file_name || !overlay_file_name) {
+        errno = EFAULT;
+        return NULL;
+    }
+
+    struct disk_t *result = malloc(sizeof(struct disk_t));
+    struct overlay_t *overlay = malloc(sizeof(struct overlay_t));
+    if (!result || !overlay) {
+        free(result);
+        free(overlay);
+        errno = ENOMEM;
+        return NULL;
+    }
+    overlay->base = MAP_FAILED;
+    overlay->bitmap = MAP_FAILED;
+    overlay->fd = -1;
+
+    result->diskFD = open(base_file_name, O_RDONLY);
+    struct stat info;
+    int err = result->diskFD == -1 || fstat(result->diskFD, &info) || info.st_size < SECTOR_SIZE;
+    if (!err) {
+        overlay->baseSize = info.st_size;
+        overlay->base = mmap(NULL, overlay->baseSize, PROT_READ, MAP_SHARED, result->diskFD, 0);
+        err = overlay->base == MAP_FAILED;
+    }
+
+    struct disk_overlay_header_t expected;
+    memset(&expected, 0, sizeof(expected));
+    if (!err) {
+        result->numberOfSectors = info.st_size / SECTOR_SIZE;
+        memcpy(expected.magic, DISK_OVERLAY_MAGIC, sizeof(expected.magic));
+        expected.version = DISK_OVERLAY_VERSION;
+        expected.number_of_sectors = result->numberOfSectors;
+        expected.base_size = info.st_size;
+        expected.base_mtime_ns = (int64_t) info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+        expected.bitmap_offset = OVERLAY_ALIGNMENT;
+        overlay->bitmapSize = ((result->numberOfSectors + 7) / 8 + OVERLAY_ALIGNMENT - 1) & ~(size_t) (OVERLAY_ALIGNMENT - 1);
+        expected.data_offset = expected.bitmap_offset + overlay->bitmapSize;
+        overlay->dataOffset = (off_t) expected.data_offset;
+
+        overlay->fd = open(overlay_file_name, O_RDWR);
+        if (overlay->fd == -1 && errno == ENOENT) {
+            overlay->fd = CreateOverlay(overlay_file_name, &expected);
+            if (overlay->fd == -1 && errno == EEXIST)overlay->fd = open(overlay_file_name, O_RDWR);
+        }
+        struct disk_overlay_header_t header;
+        err = overlay->fd == -1 || disk_pread(overlay->fd, &header, sizeof(header), 0) ||
+              memcmp(&header, &expected, sizeof(header));
+        if (err && overlay->fd != -1)errno = EINVAL;
+    }
+
+    if (!err) {
+        overlay->bitmap = mmap(NULL, overlay->bitmapSize, PROT_READ | PROT_WRITE, MAP_SHARED, overlay->fd,
+                               (off_t) expected.bitmap_offset);
+        err = overlay->bitmap == MAP_FAILED;
+    }
+
+    if (err) {
+        int savedErrno = errno;
+        if (overlay->bitmap != MAP_FAILED)munmap(overlay->bitmap, overlay->bitmapSize);
+        if (overlay->base != MAP_FAILED)munmap((void *) overlay->base, overlay->baseSize);
+        if (overlay->fd != -1)close(overlay->fd);
+        if (result->diskFD != -1)close(result->diskFD);
+        free(overlay);
+        free(result);
+        errno = savedErrno;
+        return NULL;
+    }
+
+    result->ops = &overlayOps;
+    result->backend = overlay;
+    return result;
+}
@@ -0,0 +1,25 @@
+#ifndef FAT_DISK_OVERLAY_H
+#define FAT_DISK_OVERLAY_H
+#include "file_reader.h"
+
+#define DISK_OVERLAY_MAGIC "FATCOW01"
+#define DISK_OVERLAY_VERSION 1
+
+//Overlay file: header, one bit per sector written so far, then sector n at data_offset + n * SECTOR_SIZE.
+//Sectors never written stay holes, so the file only takes the space of what changed
+//A sector's first write is synced before its bit is set, rewrites of written sectors are not ordered
+struct __attribute__((__packed__)) disk_overlay_header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t number_of_sectors;
+    uint64_t base_size; //the base the overlay was made for, a different one refuses to open
+    int64_t base_mtime_ns;
+    uint64_t bitmap_offset;
+    uint64_t data_offset;
+};
+
+//Layers overlay_file_name (created when missing) over the read-only base_file_name. The base is mapped
+//shared, so every overlay over one base reads it from the same page cache. disk_write goes to the overlay
+struct disk_t *disk_open_overlay(const char *base_file_name, const char *overlay_file_name);
+
+#endif
@@ -0,0 +1,241 @@
+#include "fat_client.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+
+static int SendAll(int fd, const void *data, size_t size, int flags) {
+    const char *bytes = data;
+    while (size) {
+        ssize_t count = send(fd, bytes, size, flags | MSG_NOSIGNAL);
+        if (count <= 0) {
+            if (count == -1 && errno == EINTR)continue;
+            return -1;
+        }
+        bytes += count;
+        size -= count;
+    }
+    return 0;
+}
+
+static int ReceiveAll(int fd, void *data, size_t size) {
+    char *bytes = data;
+    while (size) {
+        ssize_t count = recv(fd, bytes, size, 0);
+        if (count <= 0) {
+            if (count == -1 && errno == EINTR)continue;
+            if (count == 0)errno = ECONNRESET;
+            return -1;
+        }
+        bytes += count;
+        size -= count;
+    }
+    return 0;
+}
+
+
+struct fat_client_t *fat_client_connect(const char *socket_path) {
+    if (!socket_path) {
+        errno = EFAULT;
+        return NULL;
+    }
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    strcpy(address.sun_path, socket_path);
+
+    struct fat_client_t *result = malloc(sizeof(struct fat_client_t));
+    if (!result) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    result->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (result->fd == -1 || connect(result->fd, (struct sockaddr *) &address, sizeof(address))) {
+        int savedErrno = errno;
+        if (result->fd != -1)close(result->fd);
+        free(result);
+        errno = savedErrno;
+        return NULL;
+    }
+    result->nextId = 1;
+
+    return result;
+}
+
+int fat_client_close(struct fat_client_t *client) {
+    if (!client) {
+        errno = EFAULT;
+        return -1;
+    }
+    close(client->fd);
+    free(client);
+    return 0;
+}
+
+int64_t fat_client_send(struct fat_client_t *client, uint8_t op, uint8_t image, const char *name, uint32_t offset,
+                        uint32_t length) {
+    if (!client) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    size_t nameLength = name ? strlen(name) : 0;
+    if (nameLength > FAT_PROTOCOL_NAME_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    //request and name leave in one send
+    char message[sizeof(struct fat_request_t) + FAT_PROTOCOL_NAME_MAX];
+    struct fat_request_t request = {client->nextId++, op, image, (uint16_t) nameLength, offset, length};
+    memcpy(message, &request, sizeof(request));
+    if (nameLength)memcpy(message + sizeof(request), name, nameLength);
+    if (SendAll(client->fd, message, sizeof(request) + nameLength, 0))return -1;
+
+    return request.id;
+}
+
+int fat_client_receive(struct fat_client_t *client, struct fat_reply_t *reply, void *buffer, size_t capacity) {
+    if (!client || !reply || (!buffer && capacity)) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    if (ReceiveAll(client->fd, reply, sizeof(*reply)))return -1;
+
+    size_t keep = reply->length < capacity ? reply->length : capacity;
+    if (keep && ReceiveAll(client->fd, buffer, keep))return -1;
+
+    char discard[4096];
+    for (size_t left = reply->length - keep; left;) {
+        size_t step = left < sizeof(discard) ? left : sizeof(discard);
+        if (ReceiveAll(client->fd, discard, step))return -1;
+        left -= step;
+    }
+
+    return 0;
+}
+
+//Turns a payload of stat records into entries followed by their names, EPROTO when a record runs past the end
+static int DecodeStats(const char *payload, size_t length, struct fat_client_entry_t **entries, size_t *count) {
+    size_t records = 0, nameBytes = 0;
+    for (size_t at = 0; at < length; records++) {
+        struct fat_stat_t stat;
+        if (length - at < sizeof(stat)) {
+            errno = EPROTO;
+            return -1;
+        }
+        memcpy(&stat, payload + at, sizeof(stat));
+        at += sizeof(stat);
+        if (length - at < stat.name_length) {
+            errno = EPROTO;
+            return -1;
+        }
+        at += stat.name_length;
+        nameBytes += stat.name_length + 1;
+    }
+
+    struct fat_client_entry_t *result = malloc(records * sizeof(struct fat_client_entry_t) + nameBytes + 1);
+    if (!result) {
+        errno = ENOMEM;
+        return -1;
+    }
+    char *names = (char *) (result + records);
+    for (size_t i = 0, at = 0; i < records; i++) {
+        struct fat_stat_t stat;
+        memcpy(&stat, payload + at, sizeof(stat));
+        at += sizeof(stat);
+        memcpy(names, payload + at, stat.name_length);
+        names[stat.name_length] = '\0';
+        at += stat.name_length;
+        result[i].name = names;
+        result[i].attributes = stat.attributes;
+        result[i].size = stat.size;
+        names += stat.name_length + 1;
+    }
+
+    *entries = result;
+    *count = records;
+    return 0;
+}
+
+int fat_client_list(struct fat_client_t *client, uint8_t image, struct fat_client_entry_t **entries, size_t *count) {
+    if (!entries || !count) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    struct fat_reply_t reply;
+    if (fat_client_send(client, FAT_OP_LIST, image, NULL, 0, 0) == -1)return -1;
+    if (ReceiveAll(client->fd, &reply, sizeof(reply)))return -1;
+
+    char *payload = malloc(reply.length ? reply.length : 1);
+    if (!payload) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (reply.length && ReceiveAll(client->fd, payload, reply.length)) {
+        free(payload);
+        return -1;
+    }
+    if (reply.status) {
+        free(payload);
+        errno = reply.status;
+        return -1;
+    }
+
+    int result = DecodeStats(payload, reply.length, entries, count);
+    free(payload);
+    return result;
+}
+
+int fat_client_stat(struct fat_client_t *client, uint8_t image, const char *name, struct fat_client_entry_t **stat) {
+    if (!stat) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    struct fat_reply_t reply;
+    char payload[sizeof(struct fat_stat_t) + FAT_PROTOCOL_NAME_MAX];
+    if (fat_client_send(client, FAT_OP_STAT, image, name, 0, 0) == -1)return -1;
+    if (fat_client_receive(client, &reply, payload, sizeof(payload)))return -1;
+    if (reply.status) {
+        errno = reply.status;
+        return -1;
+    }
+
+    size_t count;
+    if (reply.length > sizeof(payload)) {
+        errno = EPROTO;
+        return -1;
+    }
+    if (DecodeStats(payload, reply.length, stat, &count))return -1;
+    if (count != 1) {
+        free(*stat);
+        errno = EPROTO;
+        return -1;
+    }
+    return 0;
+}
+
+ssize_t fat_client_read(struct fat_client_t *client, uint8_t image, const char *name, uint32_t offset, void *buffer,
+                        uint32_t length) {
+    struct fat_reply_t reply;
+    if (fat_client_send(client, FAT_OP_READ, image, name, offset, length) == -1)return -1;
+    if (fat_client_receive(client, &reply, buffer, length))return -1;
+    if (reply.status) {
+        errno = reply.status;
+        return -1;
+    }
+    return reply.length;
+}
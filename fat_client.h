@@ -0,0 +1,34 @@
+#ifndef FAT_FAT_CLIENT_H
+#define FAT_FAT_CLIENT_H
+#include "fat_protocol.h"
+#include <stddef.h>
+#include <sys/types.h>
+
+struct fat_client_t {
+    int fd;
+    uint32_t nextId;
+};
+
+struct fat_client_t *fat_client_connect(const char *socket_path);
+int fat_client_close(struct fat_client_t *client);
+
+//Pipelining: queue requests with fat_client_send, collect the replies in the same order with fat_client_receive.
+//send returns the request id, receive stores up to capacity payload bytes and discards the rest
+int64_t fat_client_send(struct fat_client_t *client, uint8_t op, uint8_t image, const char *name, uint32_t offset,
+                        uint32_t length);
+int fat_client_receive(struct fat_client_t *client, struct fat_reply_t *reply, void *buffer, size_t capacity);
+
+//A decoded stat record
+struct fat_client_entry_t {
+    const char *name; //terminated, stored in the same allocation as the entry
+    uint8_t attributes;
+    uint32_t size;
+};
+
+//One request, one reply. list and stat return a single allocation, free releases entries and names together
+int fat_client_list(struct fat_client_t *client, uint8_t image, struct fat_client_entry_t **entries, size_t *count);
+int fat_client_stat(struct fat_client_t *client, uint8_t image, const char *name, struct fat_client_entry_t **stat);
+ssize_t fat_client_read(struct fat_client_t *client, uint8_t image, const char *name, uint32_t offset, void *buffer,
+                        uint32_t length);
+
+#endif
@@ -0,0 +1,286 @@
+#include "fat_index.h"
+#include "lfn.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+static uint32_t IndexChecksum(const void *bootSector, const void *fat, size_t fatSize) {
+    uint32_t hash = 2166136261u;
+    const uint8_t *bytes = bootSector;
+    for (size_t i = 0; i < SECTOR_SIZE; i++) {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    bytes = fat;
+    for (size_t i = 0; i < fatSize; i++) {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+//Only plain image files are indexed, a backend's file says nothing about the sectors it serves
+static int ImageStat(struct disk_t *pdisk, uint64_t *size, int64_t *mtime) {
+    struct stat info;
+    if (pdisk->ops) {
+        errno = ENOTSUP;
+        return 1;
+    }
+    if (fstat(pdisk->diskFD, &info))return 1;
+    *size = info.st_size;
+    *mtime = (int64_t) info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+    return 0;
+}
+
+//The image's own FAT, read where fat_open reads it: size and mtime can be preserved across a rewrite
+static int ImageFatDiffers(struct disk_t *pdisk, const struct bootSectorFat *bootSector, const void *fat, size_t fatSize) {
+    size_t readSize = (size_t) bootSector->size_of_fat * SECTOR_SIZE;
+    if (fatSize > readSize)return 1;
+    char *imageFat = malloc(readSize ? readSize : 1);
+    int result = !imageFat || disk_read(pdisk, bootSector->size_of_reserved_area, imageFat, bootSector->size_of_fat) == -1 ||
+                 memcmp(imageFat, fat, fatSize) != 0;
+    free(imageFat);
+    return result;
+}
+
+static uint32_t Align8(uint32_t offset) {
+    return (offset + 7) & ~(uint32_t) 7;
+}
+
+static int WriteSection(FILE *out, size_t *written, size_t offset, const void *data, size_t size) {
+    static const char padding[8];
+    if (offset > *written) {
+        if (fwrite(padding, offset - *written, 1, out) != 1)return 1;
+        *written = offset;
+    }
+    if (size && fwrite(data, size, 1, out) != 1)return 1;
+    *written += size;
+    return 0;
+}
+
+static int IndexedEntry(const struct SFN *entry) {
+    if (entry->filename[0] == 0x0 || entry->filename[0] == (char) 0xe5)return 0;
+    if ((entry->file_attributes & (1 << 3)) >> 3)return 0;
+    return entry->low_order_address_of_first_cluster >= 2;
+}
+
+
+int fat_index_save(struct volume_t *pvolume, uint32_t first_sector, const char *index_file_name) {
+    if (!pvolume || !index_file_name) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    struct fat_index_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, FAT_INDEX_MAGIC, sizeof(header.magic));
+    header.version = FAT_INDEX_VERSION;
+    header.first_sector = first_sector;
+    header.fatInfo = pvolume->fatInfo;
+    uint64_t imageSize;
+    int64_t imageMtime;
+    if (ImageStat(pvolume->disk, &imageSize, &imageMtime))return -1;
+    header.image_size = imageSize;
+    header.image_mtime_ns = imageMtime;
+
+    size_t fatSize = pvolume->fatInfo.bytes_per_sector * pvolume->fatInfo.size_of_fat;
+    unsigned rootCount = pvolume->fatInfo.maximum_number_of_files;
+    header.checksum = IndexChecksum(&pvolume->fatInfo, pvolume->FAT1, fatSize);
+
+    struct fat_index_extent_t *extents = calloc(rootCount ? rootCount : 1, sizeof(struct fat_index_extent_t));
+    struct clusters_chain_t **chains = calloc(rootCount ? rootCount : 1, sizeof(struct clusters_chain_t *));
+    if (!extents || !chains) {
+        free(extents);
+        free(chains);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    struct SFN *rootDirectory = pvolume->rootDirectory;
+    uint32_t clustersCount = 0;
+    for (unsigned i = 0; i < rootCount; i++) {
+        if (!IndexedEntry(rootDirectory + i))continue;
+        chains[i] = get_chain_fat12(pvolume->FAT1, fatSize, rootDirectory[i].low_order_address_of_first_cluster);
+        if (!chains[i])continue;
+        extents[i].first = clustersCount;
+        extents[i].count = chains[i]->size;
+        clustersCount += chains[i]->size;
+    }
+
+    header.fat_offset = Align8(sizeof(header));
+    header.fat_size = fatSize;
+    header.root_offset = Align8(header.fat_offset + fatSize);
+    header.root_count = rootCount;
+    header.extents_offset = Align8(header.root_offset + rootCount * sizeof(struct SFN));
+    header.clusters_offset = Align8(header.extents_offset + rootCount * sizeof(struct fat_index_extent_t));
+    header.clusters_count = clustersCount;
+
+    size_t pathLength = strlen(index_file_name);
+    char *tempName = malloc(pathLength + 5);
+    FILE *out = NULL;
+    if (tempName) {
+        memcpy(tempName, index_file_name, pathLength);
+        memcpy(tempName + pathLength, ".tmp", 5);
+        out = fopen(tempName, "wb");
+    }
+
+    int err = out == NULL;
+    if (!err) {
+        size_t written = 0;
+        err |= WriteSection(out, &written, 0, &header, sizeof(header));
+        err |= WriteSection(out, &written, header.fat_offset, pvolume->FAT1, fatSize);
+        err |= WriteSection(out, &written, header.root_offset, pvolume->rootDirectory, rootCount * sizeof(struct SFN));
+        err |= WriteSection(out, &written, header.extents_offset, extents,
+                            rootCount * sizeof(struct fat_index_extent_t));
+        for (unsigned i = 0; i < rootCount; i++) {
+            if (!chains[i])continue;
+            size_t offset = written < header.clusters_offset ? header.clusters_offset : written;
+            err |= WriteSection(out, &written, offset, chains[i]->clusters, chains[i]->size * sizeof(uint16_t));
+        }
+        if (fclose(out))err = 1;
+        if (!err && rename(tempName, index_file_name))err = 1;
+        if (err)remove(tempName);
+    }
+
+    for (unsigned i = 0; i < rootCount; i++) {
+        if (!chains[i])continue;
+        free(chains[i]->clusters);
+        free(chains[i]);
+    }
+    free(chains);
+    free(extents);
+    free(tempName);
+
+    return err ? -1 : 0;
+}
+
+struct volume_t *fat_index_load(struct disk_t *pdisk, uint32_t first_sector, const char *index_file_name) {
+    if (!pdisk || !index_file_name) {
+        errno = EFAULT;
+        return NULL;
+    }
+
+    int fd = open(index_file_name, O_RDONLY);
+    if (fd == -1)return NULL;
+
+    struct stat info;
+    if (fstat(fd, &info) || (size_t) info.st_size < sizeof(struct fat_index_header_t)) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+    size_t indexSize = info.st_size;
+    void *index = mmap(NULL, indexSize, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (index == MAP_FAILED)return NULL;
+
+    const struct fat_index_header_t *header = index;
+    const char *base = index;
+    uint64_t imageSize;
+    int64_t imageMtime;
+    struct bootSectorFat bootSector;
+
+    int stale = memcmp(header->magic, FAT_INDEX_MAGIC, sizeof(header->magic)) ||
+                header->version != FAT_INDEX_VERSION || header->first_sector != first_sector;
+    if (!stale) {
+        stale = header->clusters_offset + (size_t) header->clusters_count * sizeof(uint16_t) > indexSize ||
+                header->fat_offset + (size_t) header->fat_size > indexSize ||
+                header->root_offset + (size_t) header->root_count * sizeof(struct SFN) > indexSize ||
+                header->extents_offset + (size_t) header->root_count * sizeof(struct fat_index_extent_t) > indexSize;
+    }
+    if (!stale) {
+        stale = ImageStat(pdisk, &imageSize, &imageMtime) || imageSize != header->image_size ||
+                imageMtime != header->image_mtime_ns;
+    }
+    if (!stale) {
+        stale = disk_read(pdisk, (int32_t) first_sector, &bootSector, 1) == -1 ||
+                memcmp(&bootSector, &header->fatInfo, sizeof(bootSector)) ||
+                //the copies are later walked with the boot sector's sizes, not the header's
+                header->fat_size != (uint32_t) bootSector.bytes_per_sector * bootSector.size_of_fat ||
+                header->root_count != bootSector.maximum_number_of_files ||
+                IndexChecksum(&bootSector, base + header->fat_offset, header->fat_size) != header->checksum;
+    }
+    if (!stale)stale = ImageFatDiffers(pdisk, &bootSector, base + header->fat_offset, header->fat_size);
+    if (stale) {
+        munmap(index, indexSize);
+        errno = ESTALE;
+        return NULL;
+    }
+
+    struct volume_t *result = malloc(sizeof(struct volume_t));
+    if (!result) {
+        munmap(index, indexSize);
+        errno = ENOMEM;
+        return NULL;
+    }
+    //both FATs and the root directory are used in place from the read-only mapping until fat_close
+    result->disk = pdisk;
+    result->fatInfo = bootSector;
+    result->FAT1 = (void *) (base + header->fat_offset);
+    result->FAT2 = result->FAT1;
+    result->rootDirectory = (void *) (base + header->root_offset);
+    result->index = index;
+    result->indexSize = indexSize;
+
+    result->longNames = lfn_table_build(result->rootDirectory, header->root_count);
+    if (!result->longNames) {
+        fat_close(result);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    return result;
+}
+
+struct volume_t *fat_open_indexed(struct disk_t *pdisk, uint32_t first_sector, const char *index_file_name) {
+    struct volume_t *result = fat_index_load(pdisk, first_sector, index_file_name);
+    if (result)return result;
+
+    result = fat_open(pdisk, first_sector);
+    if (!result)return NULL;
+
+    //a sidecar that cannot be written only costs the next mount its speed
+    int savedErrno = errno;
+    fat_index_save(result, first_sector, index_file_name);
+    errno = savedErrno;
+
+    return result;
+}
+
+struct clusters_chain_t *fat_index_get_chain(struct volume_t *pvolume, unsigned entry) {
+    if (!pvolume || !pvolume->index)return NULL;
+
+    const struct fat_index_header_t *header = pvolume->index;
+    const char *base = pvolume->index;
+    if (entry >= header->root_count)return NULL;
+
+    const struct fat_index_extent_t *extents = (const void *) (base + header->extents_offset);
+    struct fat_index_extent_t extent = extents[entry];
+    if (!extent.count || extent.first + extent.count > header->clusters_count)return NULL;
+
+    struct clusters_chain_t *result = malloc(sizeof(struct clusters_chain_t));
+    if (!result)return NULL;
+    result->size = extent.count;
+    result->clusters = malloc(extent.count * sizeof(uint16_t));
+    if (!result->clusters) {
+        free(result);
+        return NULL;
+    }
+    memcpy(result->clusters, base + header->clusters_offset + extent.first * sizeof(uint16_t),
+           extent.count * sizeof(uint16_t));
+
+    return result;
+}
+
+void fat_index_release(struct volume_t *pvolume) {
+    if (!pvolume || !pvolume->index)return;
+    munmap(pvolume->index, pvolume->indexSize);
+    pvolume->index = NULL;
+    pvolume->indexSize = 0;
+}
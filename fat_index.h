@@ -0,0 +1,41 @@
+#ifndef FAT_FAT_INDEX_H
+#define FAT_FAT_INDEX_H
+#include "file_reader.h"
+
+#define FAT_INDEX_MAGIC "FATIDX01"
+#define FAT_INDEX_VERSION 1
+
+//Sidecar index layout: header, raw FAT, root directory, extent table, cluster lists.
+//Every section starts on an 8 byte boundary so the file can be used straight from mmap.
+struct __attribute__((__packed__)) fat_index_header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t first_sector;
+    uint64_t image_size;
+    int64_t image_mtime_ns;
+    uint32_t checksum; //boot sector + FAT1 as stored in the index, the image's FAT is compared at load
+    uint32_t fat_offset;
+    uint32_t fat_size;
+    uint32_t root_offset;
+    uint32_t root_count;
+    uint32_t extents_offset;
+    uint32_t clusters_offset;
+    uint32_t clusters_count;
+    struct bootSectorFat fatInfo;
+};
+
+//One per root directory entry, count 0 means the chain was not indexed
+struct fat_index_extent_t {
+    uint32_t first;
+    uint32_t count;
+};
+
+int fat_index_save(struct volume_t *pvolume, uint32_t first_sector, const char *index_file_name);
+struct volume_t *fat_index_load(struct disk_t *pdisk, uint32_t first_sector, const char *index_file_name);
+struct volume_t *fat_open_indexed(struct disk_t *pdisk, uint32_t first_sector, const char *index_file_name);
+
+struct clusters_chain_t *fat_index_get_chain(struct volume_t *pvolume, unsigned entry);
+//Unmaps the index, called by fat_close once the volume's FAT and root directory are no longer used
+void fat_index_release(struct volume_t *pvolume);
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef FAT_FAT_PROTOCOL_H
+#define FAT_FAT_PROTOCOL_H
+#include <stdint.h>
+
+//Wire format between fatd and fat_client, native byte order since both ends share the host.
+//A client may send any number of requests before reading replies, they come back in request order
+
+#define FAT_OP_LIST 1 //every file and directory of an image, payload: stat records back to back, sorted by path
+#define FAT_OP_STAT 2 //one file, payload: its stat record
+#define FAT_OP_READ 3 //length bytes from offset, payload: the bytes, fewer at the end of the file
+
+#define FAT_PROTOCOL_NAME_MAX 1023 //path from the root, "\\DIR\\FILE.TXT", as long as fat_walk makes them
+
+struct __attribute__((__packed__)) fat_request_t {
+    uint32_t id; //echoed in the reply
+    uint8_t op;
+    uint8_t image; //position of the image on fatd's command line
+    uint16_t name_length; //name bytes follow the request
+    uint32_t offset;
+    uint32_t length;
+};
+
+struct __attribute__((__packed__)) fat_reply_t {
+    uint32_t id;
+    int32_t status; //0 or an errno value
+    uint32_t length; //payload bytes following the reply
+};
+
+//Stat record: the fixed fields, then name_length bytes of the path without a terminator.
+//Paths are matched without regard to case, as FAT does
+struct __attribute__((__packed__)) fat_stat_t {
+    uint16_t name_length;
+    uint8_t attributes;
+    uint32_t size;
+};
+
+#endif
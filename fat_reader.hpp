@@ -0,0 +1,267 @@
+#ifndef FAT_FAT_READER_HPP
+#define FAT_FAT_READER_HPP
+
+//Header-only C++17 layer over the reader: move-only owners for disk_t, volume_t, file_t and dir_t,
+//a range over dir_read and std::span reads when built as C++20.
+//The backend and where file chains come from are template policies, so nothing on the read path is virtual.
+//Failures throw std::system_error carrying the errno the C call set.
+
+//The system headers the C API needs come first, so extern "C" only wraps the project's own declarations
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+extern "C" {
+#include "file_reader.h"
+#include "fat_index.h"
+#include "disk_compressed.h"
+#include "disk_overlay.h"
+}
+
+#include <cerrno>
+#include <cstddef>
+#include <iterator>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+
+#if __cplusplus >= 202002L && __has_include(<span>)
+#include <span>
+#define FAT_READER_SPAN 1
+#endif
+
+namespace fat {
+
+[[noreturn]] inline void throw_errno(const char *what) {
+    throw std::system_error(errno, std::generic_category(), what);
+}
+
+
+//Backend policies, each opens a disk_t from its own arguments
+struct image_file {
+    static disk_t *open(const char *image_file_name) { return disk_open_from_file(image_file_name); }
+};
+
+struct compressed_image {
+    static disk_t *open(const char *container_file_name) { return disk_open_compressed(container_file_name); }
+};
+
+struct overlay_image {
+    static disk_t *open(const char *base_file_name, const char *overlay_file_name) {
+        return disk_open_overlay(base_file_name, overlay_file_name);
+    }
+};
+
+//Mount policies, named for where file_open finds a chain:
+//fat_table_mount walks the FAT fat_open read into memory on every file_open,
+//sidecar_index_mount maps an index file next to the image (rebuilt when stale) and copies chains out of it
+struct fat_table_mount {
+    static volume_t *mount(disk_t *disk, uint32_t first_sector) { return fat_open(disk, first_sector); }
+};
+
+struct sidecar_index_mount {
+    static volume_t *mount(disk_t *disk, uint32_t first_sector, const char *index_file_name) {
+        return fat_open_indexed(disk, first_sector, index_file_name);
+    }
+};
+
+
+template<class Backend = image_file>
+class basic_disk {
+public:
+    template<class... Args>
+    explicit basic_disk(Args &&... args) : handle_(Backend::open(std::forward<Args>(args)...)) {
+        if (!handle_)throw_errno("disk open");
+    }
+
+    basic_disk(basic_disk &&other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+    basic_disk &operator=(basic_disk &&other) noexcept {
+        std::swap(handle_, other.handle_);
+        return *this;
+    }
+    basic_disk(const basic_disk &) = delete;
+    basic_disk &operator=(const basic_disk &) = delete;
+    ~basic_disk() { if (handle_)disk_close(handle_); }
+
+    disk_t *get() const noexcept { return handle_; }
+    uint32_t sectors() const noexcept { return handle_->numberOfSectors; }
+
+    void read(int32_t first_sector, void *buffer, int32_t sectors_to_read) const {
+        if (disk_read(handle_, first_sector, buffer, sectors_to_read) == -1)throw_errno("disk_read");
+    }
+    void write(int32_t first_sector, const void *buffer, int32_t sectors_to_write) {
+        if (disk_write(handle_, first_sector, buffer, sectors_to_write) == -1)throw_errno("disk_write");
+    }
+
+#ifdef FAT_READER_SPAN
+    //Whole sectors only, a partial one is EINVAL
+    void read(int32_t first_sector, std::span<std::byte> buffer) const {
+        if (buffer.size() % SECTOR_SIZE) {
+            errno = EINVAL;
+            throw_errno("disk_read");
+        }
+        read(first_sector, buffer.data(), static_cast<int32_t>(buffer.size() / SECTOR_SIZE));
+    }
+    void write(int32_t first_sector, std::span<const std::byte> buffer) {
+        if (buffer.size() % SECTOR_SIZE) {
+            errno = EINVAL;
+            throw_errno("disk_write");
+        }
+        write(first_sector, buffer.data(), static_cast<int32_t>(buffer.size() / SECTOR_SIZE));
+    }
+#endif
+
+private:
+    disk_t *handle_;
+};
+
+using disk = basic_disk<>;
+
+
+class file {
+public:
+    explicit file(file_t *handle) noexcept : handle_(handle) {}
+    file(file &&other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+    file &operator=(file &&other) noexcept {
+        std::swap(handle_, other.handle_);
+        return *this;
+    }
+    file(const file &) = delete;
+    file &operator=(const file &) = delete;
+    ~file() { if (handle_)file_close(handle_); }
+
+    file_t *get() const noexcept { return handle_; }
+    uint32_t size() const noexcept { return handle_->fileInfo.size; }
+    uint32_t tell() const noexcept { return handle_->pos; }
+
+    //Bytes read, fewer than size only at the end of the file
+    size_t read(void *buffer, size_t size) {
+        if (!size)return 0;
+        size_t result = file_read(buffer, 1, size, handle_);
+        if (result == static_cast<size_t>(-1))throw_errno("file_read");
+        return result;
+    }
+
+    void seek(int32_t offset, int whence = SEEK_SET) {
+        if (file_seek(handle_, offset, whence) == -1)throw_errno("file_seek");
+    }
+
+#ifdef FAT_READER_SPAN
+    //Fills the front of buffer and returns that part
+    std::span<std::byte> read(std::span<std::byte> buffer) { return buffer.first(read(buffer.data(), buffer.size())); }
+
+    //Whole elements only, a trailing partial element stays in the file
+    template<class T, std::size_t Extent>
+    requires std::is_trivially_copyable_v<T> && (!std::is_const_v<T>)
+    std::span<T> read(std::span<T, Extent> buffer) {
+        uint32_t start = tell();
+        size_t bytes = read(buffer.data(), buffer.size_bytes());
+        if (bytes % sizeof(T))seek(static_cast<int32_t>(start + bytes - bytes % sizeof(T)));
+        return std::span<T>(buffer.data(), bytes / sizeof(T));
+    }
+#endif
+
+private:
+    file_t *handle_;
+};
+
+
+class directory {
+public:
+    //Input iterator, the entry lives inside it so walking allocates nothing per entry
+    class iterator {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = dir_entry_t;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const dir_entry_t *;
+        using reference = const dir_entry_t &;
+
+        iterator() noexcept = default;
+        explicit iterator(dir_t *handle) : handle_(handle) { ++*this; }
+
+        reference operator*() const noexcept { return entry_; }
+        pointer operator->() const noexcept { return &entry_; }
+
+        iterator &operator++() {
+            int result = dir_read(handle_, &entry_);
+            if (result == -1)throw_errno("dir_read");
+            if (result)handle_ = nullptr;
+            return *this;
+        }
+        void operator++(int) { ++*this; }
+
+        friend bool operator==(const iterator &a, const iterator &b) noexcept { return a.handle_ == b.handle_; }
+        friend bool operator!=(const iterator &a, const iterator &b) noexcept { return a.handle_ != b.handle_; }
+
+    private:
+        dir_t *handle_ = nullptr;
+        dir_entry_t entry_{};
+    };
+
+    explicit directory(dir_t *handle) noexcept : handle_(handle) {}
+    directory(directory &&other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+    directory &operator=(directory &&other) noexcept {
+        std::swap(handle_, other.handle_);
+        return *this;
+    }
+    directory(const directory &) = delete;
+    directory &operator=(const directory &) = delete;
+    ~directory() { if (handle_)dir_close(handle_); }
+
+    dir_t *get() const noexcept { return handle_; }
+
+    //Single pass like dir_read itself, a second begin() continues where the first stopped
+    iterator begin() { return iterator(handle_); }
+    iterator end() noexcept { return iterator(); }
+
+private:
+    dir_t *handle_;
+};
+
+
+//The volume borrows the disk, which must outlive it
+template<class Mount = fat_table_mount>
+class basic_volume {
+public:
+    template<class Backend, class... Args>
+    explicit basic_volume(const basic_disk<Backend> &disk, uint32_t first_sector = 0, Args &&... args)
+            : handle_(Mount::mount(disk.get(), first_sector, std::forward<Args>(args)...)) {
+        if (!handle_)throw_errno("fat_open");
+    }
+
+    basic_volume(basic_volume &&other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+    basic_volume &operator=(basic_volume &&other) noexcept {
+        std::swap(handle_, other.handle_);
+        return *this;
+    }
+    basic_volume(const basic_volume &) = delete;
+    basic_volume &operator=(const basic_volume &) = delete;
+    ~basic_volume() { if (handle_)fat_close(handle_); }
+
+    volume_t *get() const noexcept { return handle_; }
+
+    file open(const char *file_name) const {
+        file_t *result = file_open(handle_, file_name);
+        if (!result)throw_errno("file_open");
+        return file(result);
+    }
+    file open(const std::string &file_name) const { return open(file_name.c_str()); }
+
+    directory open_directory(const char *dir_path = "\\") const {
+        dir_t *result = dir_open(handle_, dir_path);
+        if (!result)throw_errno("dir_open");
+        return directory(result);
+    }
+
+private:
+    volume_t *handle_;
+};
+
+using volume = basic_volume<>;
+
+}
+
+#endif
@@ -0,0 +1,241 @@
+#include "fat_trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+
+struct TraceRing {
+    struct TraceRing *next;
+    int32_t tid;
+    int retired; //its thread has exited, nothing writes it any more
+    uint64_t head; //events ever written, the writer publishes each one by advancing it
+    struct fat_trace_event_t events[FAT_TRACE_RING_EVENTS];
+};
+
+static pthread_mutex_t ringsLock = PTHREAD_MUTEX_INITIALIZER; //guards rings, freeRings and retiredCount
+static struct TraceRing *rings; //live threads and exited ones not flushed yet, newest first
+static struct TraceRing *freeRings; //flushed rings of exited threads, handed to new threads
+static int retiredCount;
+static pthread_key_t ringKey;
+static pthread_once_t ringKeyOnce = PTHREAD_ONCE_INIT;
+static int ringKeyFailed;
+static int enabled;
+static __thread struct TraceRing *threadRing;
+static __thread int threadRingFailed;
+
+static uint64_t NowNs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+//Key destructor, runs on the exiting thread. The ring stays listed until a flush has written it
+static void RetireRing(void *value) {
+    struct TraceRing *ring = value;
+    threadRing = NULL;
+    threadRingFailed = 1;
+    pthread_mutex_lock(&ringsLock);
+    ring->retired = 1;
+    retiredCount++;
+    pthread_mutex_unlock(&ringsLock);
+}
+
+static void CreateRingKey(void) {
+    ringKeyFailed = pthread_key_create(&ringKey, RetireRing) != 0;
+}
+
+//A flushed ring if there is one, else the oldest unflushed one once too many exited threads wait for a flush
+static struct TraceRing *ReuseRing(void) {
+    struct TraceRing *ring = freeRings;
+    if (ring) {
+        freeRings = ring->next;
+        return ring;
+    }
+    if (retiredCount < FAT_TRACE_RETIRED_RINGS)return NULL;
+
+    struct TraceRing **oldest = NULL;
+    for (struct TraceRing **link = &rings; *link; link = &(*link)->next) {
+        if ((*link)->retired)oldest = link;
+    }
+    if (!oldest)return NULL;
+    ring = *oldest;
+    *oldest = ring->next;
+    retiredCount--;
+    return ring;
+}
+
+static struct TraceRing *ThreadRing(void) {
+    if (threadRing || threadRingFailed)return threadRing;
+
+    pthread_once(&ringKeyOnce, CreateRingKey);
+    struct TraceRing *ring = NULL;
+    if (!ringKeyFailed) {
+        pthread_mutex_lock(&ringsLock);
+        ring = ReuseRing();
+        pthread_mutex_unlock(&ringsLock);
+    }
+    if (!ring)ring = malloc(sizeof(struct TraceRing));
+    if (!ring) {
+        threadRingFailed = 1;
+        return NULL;
+    }
+    ring->tid = (int32_t) syscall(SYS_gettid);
+    ring->retired = 0;
+    ring->head = 0;
+
+    pthread_mutex_lock(&ringsLock);
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&ringsLock);
+    if (!ringKeyFailed)pthread_setspecific(ringKey, ring);
+
+    threadRing = ring;
+    return ring;
+}
+
+void fat_trace_start(void) {
+    __atomic_store_n(&enabled, 1, __ATOMIC_RELAXED);
+}
+
+void fat_trace_stop(void) {
+    __atomic_store_n(&enabled, 0, __ATOMIC_RELAXED);
+}
+
+struct fat_trace_scope_t fat_trace_scope_begin(const char *name) {
+    struct fat_trace_scope_t scope;
+    scope.active = __atomic_load_n(&enabled, __ATOMIC_RELAXED);
+    if (!scope.active)return scope;
+
+    memset(&scope.event, 0, sizeof(scope.event));
+    scope.event.name = name;
+    scope.event.start_ns = NowNs();
+    return scope;
+}
+
+void fat_trace_scope_arg(struct fat_trace_scope_t *scope, const char *key, int64_t value) {
+    if (!scope->active)return;
+    for (int i = 0; i < FAT_TRACE_ARGS; i++) {
+        if (scope->event.keys[i] && scope->event.keys[i] != key)continue;
+        scope->event.keys[i] = key;
+        scope->event.values[i] = value;
+        return;
+    }
+}
+
+void fat_trace_scope_text(struct fat_trace_scope_t *scope, const char *text) {
+    if (!scope->active || !text)return;
+    strncpy(scope->event.text, text, FAT_TRACE_TEXT - 1);
+}
+
+void fat_trace_scope_end(struct fat_trace_scope_t *scope) {
+    if (!scope->active)return;
+    scope->event.duration_ns = NowNs() - scope->event.start_ns;
+
+    struct TraceRing *ring = ThreadRing();
+    if (!ring)return;
+    //only this thread writes the ring, the flusher learns about the event from head
+    uint64_t head = ring->head;
+    ring->events[head % FAT_TRACE_RING_EVENTS] = scope->event;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+
+static void WriteText(FILE *out, const char *text) {
+    for (; *text; text++) {
+        unsigned char c = *text;
+        if (c == '"' || c == '\\')fprintf(out, "\\%c", c);
+        else if (c < 0x20 || c >= 0x7f)fprintf(out, "\\u%04x", c);
+        else fputc(c, out);
+    }
+}
+
+static void WriteEvent(FILE *out, const struct fat_trace_event_t *event, int32_t tid, int first) {
+    fprintf(out, "%s\n{\"name\":\"%s\",\"cat\":\"fat\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{",
+            first ? "" : ",", event->name, (int) getpid(), tid, event->start_ns / 1e3, event->duration_ns / 1e3);
+    int separator = 0;
+    for (int i = 0; i < FAT_TRACE_ARGS && event->keys[i]; i++) {
+        fprintf(out, "%s\"%s\":%lld", separator++ ? "," : "", event->keys[i], (long long) event->values[i]);
+    }
+    if (event->text[0]) {
+        fprintf(out, "%s\"name\":\"", separator ? "," : "");
+        WriteText(out, event->text);
+        fputc('"', out);
+    }
+    fputs("}}", out);
+}
+
+int fat_trace_flush(const char *file_name) {
+    if (!file_name) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    FILE *out = fopen(file_name, "w");
+    if (!out)return -1;
+    struct fat_trace_event_t *copy = malloc(sizeof(struct fat_trace_event_t) * FAT_TRACE_RING_EVENTS);
+    if (!copy) {
+        fclose(out);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", out);
+    int first = 1;
+    //live threads keep recording without the lock, only ring handover waits for the flush
+    pthread_mutex_lock(&ringsLock);
+    for (struct TraceRing **link = &rings; *link;) {
+        struct TraceRing *ring = *link;
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t begin = head > FAT_TRACE_RING_EVENTS ? head - FAT_TRACE_RING_EVENTS : 0;
+        for (uint64_t i = begin; i < head; i++)copy[i - begin] = ring->events[i % FAT_TRACE_RING_EVENTS];
+
+        //the owner kept recording meanwhile: whatever it may have reused since is dropped, the slot of
+        //the event in progress included
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        uint64_t after = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        uint64_t valid = after + 1 > FAT_TRACE_RING_EVENTS ? after + 1 - FAT_TRACE_RING_EVENTS : 0;
+        if (valid < begin)valid = begin;
+
+        for (uint64_t i = valid; i < head; i++) {
+            WriteEvent(out, copy + (i - begin), ring->tid, first);
+            first = 0;
+        }
+
+        if (!ring->retired) {
+            link = &ring->next;
+            continue;
+        }
+        *link = ring->next;
+        ring->next = freeRings;
+        freeRings = ring;
+        retiredCount--;
+    }
+    pthread_mutex_unlock(&ringsLock);
+    fputs("\n]}\n", out);
+
+    free(copy);
+    if (fclose(out))return -1;
+    return 0;
+}
+
+
+#ifdef FAT_TRACE
+static const char *environmentFile;
+
+static void FlushAtExit(void) {
+    if (fat_trace_flush(environmentFile))perror("fat_trace");
+}
+
+__attribute__((constructor)) static void StartFromEnvironment(void) {
+    environmentFile = getenv("FAT_TRACE_FILE");
+    if (!environmentFile || !*environmentFile)return;
+    fat_trace_start();
+    atexit(FlushAtExit);
+}
+#endif
@@ -0,0 +1,56 @@
+#ifndef FAT_FAT_TRACE_H
+#define FAT_FAT_TRACE_H
+#include <stdint.h>
+
+//Scoped event tracing written as Chrome trace-event JSON (chrome://tracing, ui.perfetto.dev).
+//Every thread records into its own ring of FAT_TRACE_RING_EVENTS, the oldest events are overwritten,
+//so recording takes no locks.
+//A thread's ring outlives it until a flush has written it, then a new thread reuses it.
+//At most FAT_TRACE_RETIRED_RINGS exited threads wait for a flush.
+//The library is only instrumented when built with -DFAT_TRACE=ON,
+//and even then nothing is recorded until fat_trace_start or FAT_TRACE_FILE in the environment,
+//which starts tracing at load and flushes to that file at exit.
+
+#define FAT_TRACE_RING_EVENTS 16384
+#define FAT_TRACE_RETIRED_RINGS 64 //beyond that a new thread takes over the oldest exited thread's ring
+#define FAT_TRACE_ARGS 3
+#define FAT_TRACE_TEXT 16
+
+struct fat_trace_event_t {
+    const char *name; //string literals only, stored as pointers
+    uint64_t start_ns;
+    uint64_t duration_ns;
+    const char *keys[FAT_TRACE_ARGS]; //NULL for unused slots
+    int64_t values[FAT_TRACE_ARGS];
+    char text[FAT_TRACE_TEXT]; //optional "name" argument, empty when unused
+};
+
+struct fat_trace_scope_t {
+    struct fat_trace_event_t event;
+    int active;
+};
+
+void fat_trace_start(void);
+void fat_trace_stop(void);
+//Writes every thread's ring, events overwritten while copying are left out. Does not clear the rings of
+//live threads, those of exited threads become free for reuse
+int fat_trace_flush(const char *file_name);
+
+struct fat_trace_scope_t fat_trace_scope_begin(const char *name);
+void fat_trace_scope_end(struct fat_trace_scope_t *scope);
+void fat_trace_scope_arg(struct fat_trace_scope_t *scope, const char *key, int64_t value);
+void fat_trace_scope_text(struct fat_trace_scope_t *scope, const char *text);
+
+#ifdef FAT_TRACE
+//Records an event named name from here to the end of the enclosing block
+#define FAT_TRACE_SCOPE(name) \
+    struct fat_trace_scope_t fatTraceScope __attribute__((cleanup(fat_trace_scope_end))) = fat_trace_scope_begin(name)
+#define FAT_TRACE_ARG(key, value) fat_trace_scope_arg(&fatTraceScope, key, (int64_t) (value))
+#define FAT_TRACE_TEXT_ARG(text) fat_trace_scope_text(&fatTraceScope, text)
+#else
+#define FAT_TRACE_SCOPE(name) do {} while (0)
+#define FAT_TRACE_ARG(key, value) do {} while (0)
+#define FAT_TRACE_TEXT_ARG(text) do {} while (0)
+#endif
+
+#endif
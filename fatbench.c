@@ -0,0 +1,121 @@
+#include "disk_direct.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+//fatbench <image> [block_kib] [passes] - reads the whole image sequentially through disk_read, buffered and
+//with disk_open_direct, each pass starting with the image evicted from the page cache.
+//Reports throughput and how much of the image the pass left in the page cache
+
+
+static double Now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void Evict(const char *file_name) {
+    int fd = open(file_name, O_RDONLY);
+    if (fd == -1)return;
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+//Percentage of the image's pages in the page cache
+static double Resident(const char *file_name) {
+    int fd = open(file_name, O_RDONLY);
+    struct stat info;
+    if (fd == -1 || fstat(fd, &info) || !info.st_size) {
+        if (fd != -1)close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)return -1;
+
+    long page = sysconf(_SC_PAGESIZE);
+    size_t pages = (info.st_size + page - 1) / page;
+    unsigned char *vector = malloc(pages);
+    size_t resident = 0;
+    if (vector && !mincore(map, info.st_size, vector)) {
+        for (size_t i = 0; i < pages; i++)resident += vector[i] & 1;
+    }
+    free(vector);
+    munmap(map, info.st_size);
+    return pages ? 100.0 * resident / pages : 0;
+}
+
+static int Pass(struct disk_t *disk, char *buffer, int32_t blockSectors, double *seconds) {
+    double start = Now();
+    for (uint32_t sector = 0; sector < disk->numberOfSectors;) {
+        int32_t count = disk->numberOfSectors - sector < (uint32_t) blockSectors ? (int32_t) (disk->numberOfSectors - sector)
+                                                                                 : blockSectors;
+        if (disk_read(disk, (int32_t) sector, buffer, count) == -1)return -1;
+        sector += count;
+    }
+    *seconds = Now() - start;
+    return 0;
+}
+
+
+int main(int argc, char **argv) {
+    if (argc < 2 || argc > 4) {
+        fprintf(stderr, "usage: %s <image> [block_kib] [passes]\n", argv[0]);
+        return 2;
+    }
+    const char *image = argv[1];
+    int blockKib = argc > 2 ? atoi(argv[2]) : 1024;
+    int passes = argc > 3 ? atoi(argv[3]) : 3;
+    if (blockKib < 1 || blockKib * 1024 / SECTOR_SIZE < 1 || passes < 1) {
+        fprintf(stderr, "fatbench: block_kib and passes must be positive\n");
+        return 2;
+    }
+    int32_t blockSectors = blockKib * 1024 / SECTOR_SIZE;
+
+    void *buffer;
+    if (posix_memalign(&buffer, 4096, (size_t) blockSectors * SECTOR_SIZE)) {
+        perror("fatbench");
+        return 1;
+    }
+
+    for (int mode = 0; mode < 2; mode++) {
+        struct disk_t *disk = mode ? disk_open_direct(image) : disk_open_from_file(image);
+        if (!disk) {
+            fprintf(stderr, "fatbench: %s: %s\n", image, strerror(errno));
+            free(buffer);
+            return 1;
+        }
+
+        double best = 0, total = 0, resident = 0;
+        for (int i = 0; i < passes; i++) {
+            double seconds;
+            Evict(image);
+            if (Pass(disk, buffer, blockSectors, &seconds)) {
+                fprintf(stderr, "fatbench: disk_read: %s\n", strerror(errno));
+                disk_close(disk);
+                free(buffer);
+                return 1;
+            }
+            double rate = disk->numberOfSectors * (double) SECTOR_SIZE / seconds / 1e6;
+            if (rate > best)best = rate;
+            total += rate;
+            resident = Resident(image);
+        }
+
+        const char *name = !mode ? "buffered" : disk_direct_active(disk) == 1 ? "direct" : "direct (fallback)";
+        printf("%-18s %9.1f MB/s best %9.1f MB/s mean, %5.1f%% of the image cached after a pass\n", name, best,
+               total / passes, resident);
+        disk_close(disk);
+    }
+
+    free(buffer);
+    return 0;
+}
@@ -0,0 +1,377 @@
+#include "file_reader.h"
+#include "disk_compressed.h"
+#include "tree_walk.h"
+#include "fat_protocol.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/sendfile.h>
+
+//fatd <socket> <image>... - keeps the images mounted and serves list/stat/read over a Unix socket.
+//Images are numbered by their position on the command line, compressed containers are recognised by magic.
+//Raw images answer reads with sendfile straight from the image file
+
+#define CONNECTION_BUFFER 4096
+
+
+struct served_file_t {
+    char *name;
+    struct fat_stat_t stat;
+    struct clusters_chain_t *chain;
+};
+
+struct served_image_t {
+    struct disk_t *disk;
+    struct volume_t *volume;
+    struct served_file_t *files; //sorted by path
+    size_t fileCount;
+    size_t fileCapacity;
+    char *listing; //the LIST payload, encoded once at mount
+    uint32_t listingLength;
+    int zeroCopy;
+    uint32_t clusterBytes;
+};
+
+struct server_t {
+    struct served_image_t *images;
+    int imageCount;
+};
+
+struct connection_t {
+    int fd;
+    struct server_t *server;
+    char in[CONNECTION_BUFFER];
+    size_t start;
+    size_t end;
+};
+
+static volatile sig_atomic_t stopping;
+
+static void Stop(int signal) {
+    (void) signal;
+    stopping = 1;
+}
+
+static int CompareFiles(const void *a, const void *b) {
+    return strcasecmp(((const struct served_file_t *) a)->name, ((const struct served_file_t *) b)->name);
+}
+
+static struct disk_t *OpenImage(const char *file_name) {
+    char magic[8] = {0};
+    FILE *probe = fopen(file_name, "rb");
+    if (!probe)return NULL;
+    size_t got = fread(magic, 1, sizeof(magic), probe);
+    fclose(probe);
+    if (got == sizeof(magic) && memcmp(magic, DISK_COMPRESSED_MAGIC, sizeof(magic)) == 0)
+        return disk_open_compressed(file_name);
+    return disk_open_from_file(file_name);
+}
+
+//fat_walk pre callback: every file and directory of the tree with its chain
+static int IndexEntry(const struct fat_walk_entry_t *entry, void *context) {
+    struct served_image_t *image = context;
+    struct volume_t *volume = image->volume;
+    if (image->fileCount == image->fileCapacity) {
+        size_t capacity = image->fileCapacity ? image->fileCapacity * 2 : 64;
+        struct served_file_t *grown = realloc(image->files, capacity * sizeof(struct served_file_t));
+        if (!grown) {
+            errno = ENOMEM;
+            return FAT_WALK_STOP;
+        }
+        image->files = grown;
+        image->fileCapacity = capacity;
+    }
+
+    struct served_file_t *file = image->files + image->fileCount;
+    memset(file, 0, sizeof(*file));
+    file->name = strdup(entry->path);
+    if (!file->name) {
+        errno = ENOMEM;
+        return FAT_WALK_STOP;
+    }
+    image->fileCount++;
+    file->stat.name_length = (uint16_t) strlen(entry->path);
+    file->stat.attributes = entry->sfn->file_attributes;
+    file->stat.size = entry->sfn->size;
+    if (entry->sfn->low_order_address_of_first_cluster >= 2) {
+        file->chain = get_chain_fat12(volume->FAT1, volume->fatInfo.size_of_fat * volume->fatInfo.bytes_per_sector,
+                                      entry->sfn->low_order_address_of_first_cluster);
+    }
+    return FAT_WALK_CONTINUE;
+}
+
+static size_t EncodeStat(char *out, const struct served_file_t *file) {
+    memcpy(out, &file->stat, sizeof(file->stat));
+    memcpy(out + sizeof(file->stat), file->name, file->stat.name_length);
+    return sizeof(file->stat) + file->stat.name_length;
+}
+
+//Directory index built once at mount: every entry of the tree by path with its chain, sorted for binary search
+static int MountImage(struct served_image_t *image, const char *file_name) {
+    memset(image, 0, sizeof(*image));
+    image->disk = OpenImage(file_name);
+    image->volume = image->disk ? fat_open(image->disk, 0) : NULL;
+    if (!image->volume)return 1;
+
+    struct volume_t *volume = image->volume;
+    image->zeroCopy = image->disk->ops == NULL;
+    image->clusterBytes = volume->fatInfo.sectors_per_clusters * SECTOR_SIZE;
+
+    struct fat_walk_options_t walk = {IndexEntry, NULL, image, 0, 1};
+    if (fat_walk(volume, &walk))return 1;
+    qsort(image->files, image->fileCount, sizeof(struct served_file_t), CompareFiles);
+
+    size_t length = 0;
+    for (size_t i = 0; i < image->fileCount; i++)length += sizeof(struct fat_stat_t) + image->files[i].stat.name_length;
+    if (length > UINT32_MAX) {
+        errno = EFBIG;
+        return 1;
+    }
+    image->listing = malloc(length ? length : 1);
+    if (!image->listing) {
+        errno = ENOMEM;
+        return 1;
+    }
+    image->listingLength = (uint32_t) length;
+    for (size_t i = 0, at = 0; i < image->fileCount; i++)at += EncodeStat(image->listing + at, image->files + i);
+
+    return 0;
+}
+
+static void UnmountImage(struct served_image_t *image) {
+    for (size_t i = 0; i < image->fileCount; i++) {
+        free(image->files[i].name);
+        if (!image->files[i].chain)continue;
+        free(image->files[i].chain->clusters);
+        free(image->files[i].chain);
+    }
+    free(image->files);
+    free(image->listing);
+    if (image->volume)fat_close(image->volume);
+    if (image->disk)disk_close(image->disk);
+}
+
+
+static int Receive(struct connection_t *connection, void *data, size_t size) {
+    char *bytes = data;
+    while (size) {
+        if (connection->start == connection->end) {
+            ssize_t count = recv(connection->fd, connection->in, sizeof(connection->in), 0);
+            if (count <= 0) {
+                if (count == -1 && errno == EINTR)continue;
+                return -1;
+            }
+            connection->start = 0;
+            connection->end = count;
+        }
+        size_t step = connection->end - connection->start < size ? connection->end - connection->start : size;
+        memcpy(bytes, connection->in + connection->start, step);
+        connection->start += step;
+        bytes += step;
+        size -= step;
+    }
+    return 0;
+}
+
+static int SendAll(int fd, const void *data, size_t size, int flags) {
+    const char *bytes = data;
+    while (size) {
+        ssize_t count = send(fd, bytes, size, flags | MSG_NOSIGNAL);
+        if (count <= 0) {
+            if (count == -1 && errno == EINTR)continue;
+            return -1;
+        }
+        bytes += count;
+        size -= count;
+    }
+    return 0;
+}
+
+static int SendReply(struct connection_t *connection, uint32_t id, int status, const void *payload, uint32_t length) {
+    struct fat_reply_t reply = {id, status, status ? 0 : length};
+    //more replies are likely queued behind this one while the client pipelines
+    int more = connection->start != connection->end || (!status && length) ? MSG_MORE : 0;
+    if (SendAll(connection->fd, &reply, sizeof(reply), more))return -1;
+    if (!status && length)return SendAll(connection->fd, payload, length, connection->start != connection->end ? MSG_MORE : 0);
+    return 0;
+}
+
+static struct served_file_t *FindFile(struct served_image_t *image, const char *name) {
+    //root files may still be named without the leading backslash
+    char path[FAT_PROTOCOL_NAME_MAX + 2];
+    struct served_file_t key;
+    snprintf(path, sizeof(path), "%s%s", name[0] == '\\' ? "" : "\\", name);
+    key.name = path;
+    return bsearch(&key, image->files, image->fileCount, sizeof(struct served_file_t), CompareFiles);
+}
+
+//Streams [offset, offset + length) of file, one sendfile or disk_read per run of contiguous clusters
+static int SendFileData(struct connection_t *connection, struct served_image_t *image, struct served_file_t *file,
+                        uint32_t offset, uint32_t length, char *buffer) {
+    struct clusters_chain_t *chain = file->chain;
+    uint32_t clusterBytes = image->clusterBytes;
+
+    while (length) {
+        size_t index = offset / clusterBytes;
+        uint32_t within = offset % clusterBytes;
+        size_t run = 1;
+        while (index + run < chain->size && chain->clusters[index + run] == chain->clusters[index] + run &&
+               (uint64_t) run * clusterBytes - within < length)
+            run++;
+        uint32_t bytes = (uint32_t) (run * clusterBytes - within);
+        if (bytes > length)bytes = length;
+
+        int32_t sector = fat_cluster_sector(image->volume, chain->clusters[index]);
+        if (image->zeroCopy) {
+            off_t position = (off_t) sector * SECTOR_SIZE + within;
+            for (uint32_t left = bytes; left;) {
+                ssize_t count = sendfile(connection->fd, image->disk->diskFD, &position, left);
+                if (count <= 0) {
+                    if (count == -1 && errno == EINTR)continue;
+                    return -1;
+                }
+                left -= count;
+            }
+        } else {
+            uint8_t sectorsPerCluster = image->volume->fatInfo.sectors_per_clusters;
+            uint32_t skip = within;
+            for (uint32_t sent = 0; sent < bytes; skip = 0) {
+                uint32_t take = clusterBytes - skip < bytes - sent ? clusterBytes - skip : bytes - sent;
+                if (disk_read(image->disk, sector, buffer, sectorsPerCluster) == -1)return -1;
+                if (SendAll(connection->fd, buffer + skip, take, sent + take < length ? MSG_MORE : 0))return -1;
+                sector += sectorsPerCluster;
+                sent += take;
+            }
+        }
+
+        offset += bytes;
+        length -= bytes;
+    }
+    return 0;
+}
+
+static int Serve(struct connection_t *connection, const struct fat_request_t *request, const char *name, char *buffer) {
+    struct server_t *server = connection->server;
+    if (request->image >= server->imageCount)return SendReply(connection, request->id, ENODEV, NULL, 0);
+    struct served_image_t *image = server->images + request->image;
+
+    if (request->op == FAT_OP_LIST) {
+        //the index is immutable, its encoding goes out as it is
+        return SendReply(connection, request->id, 0, image->listing, image->listingLength);
+    }
+
+    struct served_file_t *file = FindFile(image, name);
+    if (!file)return SendReply(connection, request->id, ENOENT, NULL, 0);
+    if (request->op == FAT_OP_STAT) {
+        size_t length = EncodeStat(buffer, file);
+        return SendReply(connection, request->id, 0, buffer, (uint32_t) length);
+    }
+    if (request->op != FAT_OP_READ)return SendReply(connection, request->id, EINVAL, NULL, 0);
+    if (file->stat.attributes & (1 << 4))return SendReply(connection, request->id, EISDIR, NULL, 0);
+
+    uint32_t offset = request->offset, length = request->length;
+    if (offset >= file->stat.size)length = 0;
+    else if (length > file->stat.size - offset)length = file->stat.size - offset;
+    if (length && (!file->chain || (uint64_t) file->chain->size * image->clusterBytes < (uint64_t) offset + length))
+        return SendReply(connection, request->id, EIO, NULL, 0);
+
+    struct fat_reply_t reply = {request->id, 0, length};
+    if (SendAll(connection->fd, &reply, sizeof(reply), length ? MSG_MORE : 0))return -1;
+    return length ? SendFileData(connection, image, file, offset, length, buffer) : 0;
+}
+
+static void *ConnectionThread(void *arg) {
+    struct connection_t *connection = arg;
+    char *buffer = malloc(128 * SECTOR_SIZE); //largest cluster FAT allows
+
+    struct fat_request_t request;
+    char name[FAT_PROTOCOL_NAME_MAX + 1];
+    while (buffer && !Receive(connection, &request, sizeof(request))) {
+        if (request.name_length > FAT_PROTOCOL_NAME_MAX)break;
+        if (Receive(connection, name, request.name_length))break;
+        name[request.name_length] = '\0';
+        if (Serve(connection, &request, name, buffer))break;
+    }
+
+    free(buffer);
+    close(connection->fd);
+    free(connection);
+    return NULL;
+}
+
+
+int main(int argc, char **argv) {
+    if (argc < 3 || argc - 2 > 256) {
+        fprintf(stderr, "usage: %s <socket> <image>...\n", argv[0]);
+        return 2;
+    }
+
+    struct server_t server;
+    server.imageCount = argc - 2;
+    server.images = calloc(server.imageCount, sizeof(struct served_image_t));
+    if (!server.images) {
+        perror("fatd");
+        return 1;
+    }
+    for (int i = 0; i < server.imageCount; i++) {
+        if (MountImage(server.images + i, argv[i + 2])) {
+            fprintf(stderr, "fatd: %s: %s\n", argv[i + 2], strerror(errno));
+            for (int j = 0; j <= i; j++)UnmountImage(server.images + j);
+            free(server.images);
+            return 1;
+        }
+    }
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, argv[1], sizeof(address.sun_path) - 1);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(argv[1]);
+    if (listener == -1 || bind(listener, (struct sockaddr *) &address, sizeof(address)) || listen(listener, 64)) {
+        perror("fatd");
+        return 1;
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = Stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    while (!stopping) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd == -1)continue;
+
+        struct connection_t *connection = malloc(sizeof(struct connection_t));
+        pthread_t thread;
+        if (!connection) {
+            close(fd);
+            continue;
+        }
+        connection->fd = fd;
+        connection->server = &server;
+        connection->start = connection->end = 0;
+        if (pthread_create(&thread, NULL, ConnectionThread, connection)) {
+            close(fd);
+            free(connection);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    //connection threads still running keep using the images, so they are left to the exit
+    close(listener);
+    unlink(argv[1]);
+    return 0;
+}
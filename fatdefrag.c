@@ -0,0 +1,60 @@
+#include "file_reader.h"
+#include "defrag.h"
+
+#include <stdio.h>
+#include <string.h>
+
+//fatdefrag report <image.img>               - per file and volume fragmentation
+//fatdefrag rewrite <image.img> <output.img> - writes a defragmented copy of the image
+
+
+static int Report(struct volume_t *volume) {
+    struct fragmentation_report_t *report = fat_fragmentation(volume);
+    if (!report) {
+        perror("fatdefrag");
+        return 1;
+    }
+
+    for (size_t i = 0; i < report->fileCount; i++) {
+        struct fragmentation_file_t *file = report->files + i;
+        printf("%-24s %s clusters %u extents %u\n", file->path, file->is_directory ? "dir " : "file", file->clusters,
+               file->extents);
+    }
+    printf("files %zu fragmented %u clusters %u extents %u average run %.2f\n", report->fileCount,
+           report->fragmentedFiles, report->totalClusters, report->totalExtents, report->averageRunLength);
+    printf("gaps:");
+    for (int i = 0; i < DEFRAG_GAP_BUCKETS; i++)printf(" %u", report->gapHistogram[i]);
+    printf("\n");
+
+    fat_fragmentation_free(report);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int rewrite = argc == 4 && strcmp(argv[1], "rewrite") == 0;
+    if (!rewrite && !(argc == 3 && strcmp(argv[1], "report") == 0)) {
+        fprintf(stderr, "usage: %s report <image.img>\n"
+                        "       %s rewrite <image.img> <output.img>\n", argv[0], argv[0]);
+        return 2;
+    }
+
+    struct disk_t *disk = disk_open_from_file(argv[2]);
+    struct volume_t *volume = disk ? fat_open(disk, 0) : NULL;
+    if (!volume) {
+        perror("fatdefrag");
+        if (disk)disk_close(disk);
+        return 1;
+    }
+
+    int err;
+    if (rewrite) {
+        err = fat_defragment(volume, argv[3]) != 0;
+        if (err)perror("fatdefrag");
+    } else {
+        err = Report(volume);
+    }
+
+    fat_close(volume);
+    disk_close(disk);
+    return err;
+}
@@ -0,0 +1,61 @@
+#include "file_reader.h"
+#include "image_diff.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+//fatdiff diff <base.img> <target.img> [delta]  - reports changed clusters and files, optionally writes a delta
+//fatdiff apply <base.img> <delta>              - applies a delta onto the base image in place
+
+
+static int Diff(const char *baseName, const char *targetName, const char *deltaName) {
+    struct disk_t *baseDisk = disk_open_from_file(baseName);
+    struct disk_t *targetDisk = disk_open_from_file(targetName);
+    struct volume_t *base = baseDisk ? fat_open(baseDisk, 0) : NULL;
+    struct volume_t *target = targetDisk ? fat_open(targetDisk, 0) : NULL;
+    struct image_diff_t *diff = base && target ? image_diff(base, target, 0) : NULL;
+
+    int err = diff == NULL;
+    if (err) {
+        perror("fatdiff");
+    } else {
+        printf("changed metadata sectors: %u\n", diff->changedSectorCount);
+        for (uint32_t i = 0; i < diff->changedEntryCount; i++)printf("changed entry %s\n", diff->paths[diff->changedEntries[i]]);
+        printf("changed clusters: %u/%u\n", diff->changedClusterCount, diff->clusterCount);
+        for (uint32_t i = 0; i < diff->changedClusterCount; i++) {
+            int owner = diff->clusterOwners[i];
+            printf("cluster %u %s\n", diff->changedClusters[i], owner == -1 ? "-" : diff->paths[owner]);
+        }
+        if (deltaName && image_delta_write(diff, base, target, deltaName)) {
+            perror("fatdiff");
+            err = 1;
+        }
+    }
+
+    image_diff_free(diff);
+    if (base)fat_close(base);
+    if (target)fat_close(target);
+    if (baseDisk)disk_close(baseDisk);
+    if (targetDisk)disk_close(targetDisk);
+
+    return err;
+}
+
+int main(int argc, char **argv) {
+    if (argc >= 4 && argc <= 5 && strcmp(argv[1], "diff") == 0) {
+        return Diff(argv[2], argv[3], argc == 5 ? argv[4] : NULL);
+    }
+    if (argc == 4 && strcmp(argv[1], "apply") == 0) {
+        if (image_delta_apply(argv[2], argv[3])) {
+            perror("fatdiff");
+            return 1;
+        }
+        return 0;
+    }
+
+    fprintf(stderr, "usage: %s diff <base.img> <target.img> [delta]\n"
+                    "       %s apply <base.img> <delta>\n", argv[0], argv[0]);
+    return 2;
+}
@@ -0,0 +1,139 @@
+#include "fat_client.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+//fatload <socket> <image> <threads> <seconds> [depth] - reads every file of an image from fatd in a loop,
+//keeping depth requests in flight per connection, and reports request and byte throughput
+
+#define LOAD_READ_LENGTH 65536
+
+
+struct load_t {
+    const char *socketPath;
+    uint8_t image;
+    int depth;
+    double seconds;
+    struct fat_client_entry_t *files;
+    size_t fileCount;
+
+    uint64_t requests;
+    uint64_t bytes;
+    int failed;
+};
+
+static double Now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void *LoadThread(void *arg) {
+    struct load_t *load = arg;
+    struct fat_client_t *client = fat_client_connect(load->socketPath);
+    char *buffer = malloc(LOAD_READ_LENGTH);
+    if (!client || !buffer) {
+        __atomic_store_n(&load->failed, 1, __ATOMIC_RELAXED);
+        free(buffer);
+        if (client)fat_client_close(client);
+        return NULL;
+    }
+
+    uint64_t requests = 0, bytes = 0;
+    size_t next = 0;
+    int inFlight = 0;
+    double end = Now() + load->seconds;
+    int running = 1;
+    while (running || inFlight) {
+        while (running && inFlight < load->depth) {
+            const struct fat_client_entry_t *file = load->files + next++ % load->fileCount;
+            if (fat_client_send(client, FAT_OP_READ, load->image, file->name, 0, LOAD_READ_LENGTH) == -1)goto fail;
+            inFlight++;
+        }
+
+        struct fat_reply_t reply;
+        if (fat_client_receive(client, &reply, buffer, LOAD_READ_LENGTH))goto fail;
+        if (reply.status)goto fail;
+        inFlight--;
+        requests++;
+        bytes += reply.length;
+        if (running && (requests & 63) == 0 && Now() >= end)running = 0;
+    }
+
+    __atomic_add_fetch(&load->requests, requests, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&load->bytes, bytes, __ATOMIC_RELAXED);
+    free(buffer);
+    fat_client_close(client);
+    return NULL;
+
+fail:
+    __atomic_store_n(&load->failed, 1, __ATOMIC_RELAXED);
+    free(buffer);
+    fat_client_close(client);
+    return NULL;
+}
+
+
+int main(int argc, char **argv) {
+    if (argc < 5 || argc > 6) {
+        fprintf(stderr, "usage: %s <socket> <image> <threads> <seconds> [depth]\n", argv[0]);
+        return 2;
+    }
+
+    struct load_t load;
+    memset(&load, 0, sizeof(load));
+    load.socketPath = argv[1];
+    load.image = (uint8_t) atoi(argv[2]);
+    int threads = atoi(argv[3]);
+    load.seconds = atof(argv[4]);
+    load.depth = argc == 6 ? atoi(argv[5]) : 16;
+    if (threads < 1 || load.seconds <= 0 || load.depth < 1) {
+        fprintf(stderr, "fatload: threads, seconds and depth must be positive\n");
+        return 2;
+    }
+
+    struct fat_client_t *client = fat_client_connect(load.socketPath);
+    struct fat_client_entry_t *entries = NULL;
+    size_t count = 0;
+    if (!client || fat_client_list(client, load.image, &entries, &count)) {
+        fprintf(stderr, "fatload: %s: %s\n", load.socketPath, strerror(errno));
+        if (client)fat_client_close(client);
+        return 1;
+    }
+    fat_client_close(client);
+
+    //directories would only answer EISDIR
+    load.files = entries;
+    for (size_t i = 0; i < count; i++) {
+        if (!(entries[i].attributes & (1 << 4)))load.files[load.fileCount++] = entries[i];
+    }
+    if (!load.fileCount) {
+        fprintf(stderr, "fatload: image %d has no files\n", load.image);
+        free(entries);
+        return 1;
+    }
+
+    pthread_t *workers = malloc(sizeof(pthread_t) * threads);
+    if (!workers) {
+        free(entries);
+        return 1;
+    }
+    double start = Now();
+    int started = 0;
+    for (; started < threads; started++) {
+        if (pthread_create(workers + started, NULL, LoadThread, &load))break;
+    }
+    for (int i = 0; i < started; i++)pthread_join(workers[i], NULL);
+    double elapsed = Now() - start;
+
+    printf("%d connections, depth %d, %.2f s\n", started, load.depth, elapsed);
+    printf("%.0f req/s, %.1f MB/s\n", load.requests / elapsed, load.bytes / elapsed / 1e6);
+
+    free(workers);
+    free(entries);
+    return load.failed ? 1 : 0;
+}
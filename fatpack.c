@@ -0,0 +1,20 @@
+#include "disk_compressed.h"
+
+#include <stdio.h>
+
+//fatpack <image.img> <container> - converts a raw image into a compressed container for disk_open_compressed
+
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <image.img> <container>\n", argv[0]);
+        return 2;
+    }
+
+    if (disk_compress_image(argv[1], argv[2])) {
+        perror("fatpack");
+        return 1;
+    }
+
+    return 0;
+}
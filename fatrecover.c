@@ -0,0 +1,77 @@
+#include "file_reader.h"
+#include "recover.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//fatrecover <image.img> [output_dir] [threads] - lists deleted entries and carved signatures in free clusters,
+//with output_dir also writes what can be recovered there. The image is opened read-only
+
+
+static const char *states[] = {"contiguous", "fragmented", "overwritten", "empty"};
+
+//Flattens a recovered path into one file name, "\DIR\_ILE.TXT" becomes "DIR__ILE.TXT"
+static void OutputName(const char *directory, const char *path, char *name, size_t size) {
+    while (*path == '\\')path++;
+    int length = snprintf(name, size, "%s/", directory);
+    for (size_t i = length; *path && i + 1 < size; i++, path++) {
+        name[i] = *path == '\\' || *path == '/' ? '_' : *path;
+        name[i + 1] = '\0';
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2 || argc > 4) {
+        fprintf(stderr, "usage: %s <image.img> [output_dir] [threads]\n", argv[0]);
+        return 2;
+    }
+    const char *output = argc > 2 ? argv[2] : NULL;
+    int threads = argc > 3 ? atoi(argv[3]) : 0;
+
+    struct disk_t *disk = disk_open_from_file(argv[1]);
+    struct volume_t *volume = disk ? fat_open(disk, 0) : NULL;
+    if (!volume) {
+        perror("fatrecover");
+        if (disk)disk_close(disk);
+        return 1;
+    }
+
+    struct recovery_report_t *report = fat_recover_scan(volume, threads);
+    if (!report) {
+        perror("fatrecover");
+        fat_close(volume);
+        disk_close(disk);
+        return 1;
+    }
+
+    int err = 0;
+    char name[RECOVER_PATH_LENGTH + 512];
+    for (size_t i = 0; i < report->fileCount; i++) {
+        struct recovered_file_t *file = report->files + i;
+        printf("%-24s %s size %u first %u %s clusters %zu\n", file->path, file->is_directory ? "dir " : "file",
+               file->entry.size, file->entry.low_order_address_of_first_cluster, states[file->state], file->clusterCount);
+        if (!output || !file->clusterCount)continue;
+        OutputName(output, file->path, name, sizeof(name));
+        if (fat_recover_extract(volume, file, name)) {
+            perror(name);
+            err = 1;
+        }
+    }
+    for (size_t i = 0; i < report->carvedCount; i++) {
+        struct carved_file_t *carved = report->carved + i;
+        printf("carved %-17s cluster %u clusters %u\n", carved->type, carved->first_cluster, carved->clusters);
+        if (!output)continue;
+        snprintf(name, sizeof(name), "%s/carved_%u.%s", output, carved->first_cluster, carved->extension);
+        if (fat_carve_extract(volume, carved, name)) {
+            perror(name);
+            err = 1;
+        }
+    }
+    printf("deleted %zu carved %zu free clusters %u\n", report->fileCount, report->carvedCount, report->freeClusters);
+
+    fat_recover_free(report);
+    fat_close(volume);
+    disk_close(disk);
+    return err;
+}
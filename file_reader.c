@@ -1,10 +1,17 @@
 #include "file_reader.h"
 #include "FatStructures.h"
+#include "fat_index.h"
+#include "dir_scan.h"
+#include "fat_trace.h"
+#include "lfn.h"
 
 #include <stdlib.h>
 #include <errno.h>
 #include <memory.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 //#include "SmartPointers.h"
 
@@ -21,52 +28,103 @@ struct disk_t *disk_open_from_file(const char *volume_file_name) {
         return NULL;
     }
 
-    result->diskFD = fopen(volume_file_name, "rb");
-    if (!result->diskFD) {
+    result->diskFD = open(volume_file_name, O_RDONLY);
+    if (result->diskFD == -1) {
         free(result);
         errno = ENOENT;
         return NULL;
     }
 
-    result->numberOfSectors = 0;
-    char temp[SECTOR_SIZE];
-    while (fread(temp, SECTOR_SIZE, 1, result->diskFD))result->numberOfSectors++;
+    struct stat info;
+    if (fstat(result->diskFD, &info)) {
+        close(result->diskFD);
+        free(result);
+        return NULL;
+    }
+    result->numberOfSectors = info.st_size / SECTOR_SIZE;
+    result->ops = NULL;
+    result->backend = NULL;
 
 
     return result;
 }
 
+int disk_pread(int fd, void *buffer, size_t size, off_t offset) {
+    char *dest = buffer;
+    while (size) {
+        ssize_t count = pread(fd, dest, size, offset);
+        if (count <= 0) {
+            if (count == -1 && errno == EINTR)continue;
+            if (count == 0)errno = EIO;
+            return -1;
+        }
+        dest += count;
+        offset += count;
+        size -= count;
+    }
+    return 0;
+}
+
 int disk_read(struct disk_t *pdisk, int32_t first_sector, void *buffer, int32_t sectors_to_read) {
+    FAT_TRACE_SCOPE("disk_read");
+    FAT_TRACE_ARG("first_sector", first_sector);
+    FAT_TRACE_ARG("sectors", sectors_to_read);
     if (!pdisk || !buffer) {
         errno = EFAULT;
         return -1;
     }
 
-    if ((uint32_t) (first_sector + sectors_to_read) > pdisk->numberOfSectors) {
+    if (first_sector < 0 || sectors_to_read < 0 ||
+        (uint64_t) first_sector + sectors_to_read > pdisk->numberOfSectors) {
         errno = ERANGE;
         return -1;
     }
 
-    fseek(pdisk->diskFD, first_sector * SECTOR_SIZE, SEEK_SET);
+    if (pdisk->ops)return pdisk->ops->read(pdisk, first_sector, buffer, sectors_to_read);
 
-    fread(buffer, SECTOR_SIZE, sectors_to_read, pdisk->diskFD);
+    //pread keeps no file offset, concurrent readers of one disk do not race on it
+    if (disk_pread(pdisk->diskFD, buffer, (size_t) sectors_to_read * SECTOR_SIZE, (off_t) first_sector * SECTOR_SIZE))
+        return -1;
 
 
     return sectors_to_read;
 }
 
+int disk_write(struct disk_t *pdisk, int32_t first_sector, const void *buffer, int32_t sectors_to_write) {
+    if (!pdisk || !buffer) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    if (first_sector < 0 || sectors_to_write < 0 ||
+        (uint64_t) first_sector + sectors_to_write > pdisk->numberOfSectors) {
+        errno = ERANGE;
+        return -1;
+    }
+
+    if (!pdisk->ops || !pdisk->ops->write) {
+        errno = EROFS;
+        return -1;
+    }
+
+    return pdisk->ops->write(pdisk, first_sector, buffer, sectors_to_write);
+}
+
 int disk_close(struct disk_t *pdisk) {
     if (!pdisk) {
         errno = EFAULT;
         return -1;
     }
-    fclose(pdisk->diskFD);
+    if (pdisk->ops)pdisk->ops->close(pdisk);
+    close(pdisk->diskFD);
     free(pdisk);
     return 0;
 }
 
 
 struct volume_t *fat_open(struct disk_t *pdisk, uint32_t first_sector) {
+    FAT_TRACE_SCOPE("fat_open");
+    FAT_TRACE_ARG("first_sector", first_sector);
     if (!pdisk) {
         errno = EFAULT;
         return NULL;
@@ -114,6 +172,8 @@ struct volume_t *fat_open(struct disk_t *pdisk, uint32_t first_sector) {
     }
 
     result->disk = pdisk;
+    result->index = NULL;
+    result->indexSize = 0;
 
     disk_read(pdisk, result->fatInfo.size_of_reserved_area, result->FAT1, result->fatInfo.size_of_fat);
     disk_read(pdisk, result->fatInfo.size_of_reserved_area + result->fatInfo.size_of_fat, result->FAT2,
@@ -132,6 +192,16 @@ struct volume_t *fat_open(struct disk_t *pdisk, uint32_t first_sector) {
     disk_read(pdisk, result->fatInfo.size_of_reserved_area + result->fatInfo.size_of_fat * 2, result->rootDirectory,
               (int) sizeof(struct SFN) * result->fatInfo.maximum_number_of_files / result->fatInfo.bytes_per_sector);
 
+    result->longNames = lfn_table_build(result->rootDirectory, result->fatInfo.maximum_number_of_files);
+    if (!result->longNames) {
+        free(result->FAT1);
+        free(result->FAT2);
+        free(result->rootDirectory);
+        free(result);
+        errno = ENOMEM;
+        return NULL;
+    }
+
 
     return result;
 }
@@ -141,23 +211,20 @@ int fat_close(struct volume_t *pvolume) {
         errno = EFAULT;
         return -1;
     }
-    free(pvolume->FAT1);
-    free(pvolume->FAT2);
-    free(pvolume->rootDirectory);
-    free(pvolume);
-    return 0;
-}
-
-int CompareFatWords(const char *a, const char *b) {
-
-    for (int i = 0; i < 11; i++) {
-        if (a[i] != b[i])return 1;
+    if (!pvolume->index) {
+        free(pvolume->FAT1);
+        free(pvolume->FAT2);
+        free(pvolume->rootDirectory);
     }
-
+    lfn_table_free(pvolume->longNames);
+    fat_index_release(pvolume);
+    free(pvolume);
     return 0;
 }
 
 struct clusters_chain_t *get_chain_fat12(void *buffer, size_t size, uint16_t first_cluster) {
+    FAT_TRACE_SCOPE("get_chain_fat12");
+    FAT_TRACE_ARG("first_cluster", first_cluster);
     if (!buffer)return NULL;
     unsigned numberOfCluster = size / 3 * 2;
     if (first_cluster > numberOfCluster || !numberOfCluster)return NULL;
@@ -194,11 +261,14 @@ struct clusters_chain_t *get_chain_fat12(void *buffer, size_t size, uint16_t fir
     for (size_t i = 0, next = first_cluster; i < result->size; i++, next = TableValue(next, buffer)) {
         result->clusters[i] = next;
     }
+    FAT_TRACE_ARG("clusters", result->size);
 
     return result;
 }
 
 struct file_t *file_open(struct volume_t *pvolume, const char *file_name) {
+    FAT_TRACE_SCOPE("file_open");
+    FAT_TRACE_TEXT_ARG(file_name);
 
     if (!pvolume||!file_name) {
         errno = EFAULT;
@@ -214,6 +284,7 @@ struct file_t *file_open(struct volume_t *pvolume, const char *file_name) {
     }
 
     int found = 0;
+    unsigned entryNumber = 0;
 
 
     char fixedName[11]="           ";
@@ -242,18 +313,18 @@ struct file_t *file_open(struct volume_t *pvolume, const char *file_name) {
 
     }
 
-    for (unsigned i = 0; i < pvolume->fatInfo.maximum_number_of_files; i++) {
-        if (CompareFatWords(rootDirectory->filename, fixedName) == 0) {
-            if ((rootDirectory->file_attributes & ( 1 << 4 )) >> 4 == 1) {
-                errno = EISDIR;
-                free(result);
-                return NULL;
-            }
-            found = 1;
-            result->fileInfo = *rootDirectory;
-            break;
+    int entry = dir_scan_find(rootDirectory, pvolume->fatInfo.maximum_number_of_files, fixedName);
+    if (entry == -1)entry = lfn_table_find(pvolume->longNames, file_name);
+    if (entry != -1) {
+        rootDirectory += entry;
+        if ((rootDirectory->file_attributes & ( 1 << 4 )) >> 4 == 1) {
+            errno = EISDIR;
+            free(result);
+            return NULL;
         }
-        rootDirectory++;
+        found = 1;
+        entryNumber = entry;
+        result->fileInfo = *rootDirectory;
     }
 
 
@@ -266,7 +337,9 @@ struct file_t *file_open(struct volume_t *pvolume, const char *file_name) {
     result->pos = 0;
     result->fat = pvolume;
 
-    result->fatChain = get_chain_fat12(pvolume->FAT1, pvolume->fatInfo.size_of_fat * pvolume->fatInfo.bytes_per_sector,
+    result->fatChain = fat_index_get_chain(pvolume, entryNumber);
+    if (!result->fatChain)
+        result->fatChain = get_chain_fat12(pvolume->FAT1, pvolume->fatInfo.size_of_fat * pvolume->fatInfo.bytes_per_sector,
                                        result->fileInfo.low_order_address_of_first_cluster);
 
     if (!result->fatChain) {
@@ -292,12 +365,17 @@ int file_close(struct file_t *stream) {
 }
 
 
-int GetFileCluster(struct file_t *stream, void *buffer, int clusterNumber) {
+int32_t fat_cluster_sector(struct volume_t *pvolume, uint16_t cluster) {
     int sectorNumber=0;
-    sectorNumber+=stream->fat->fatInfo.size_of_reserved_area;
-    sectorNumber+=stream->fat->fatInfo.size_of_fat*stream->fat->fatInfo.number_of_fats;
-    sectorNumber+=stream->fat->fatInfo.maximum_number_of_files*(int)sizeof(struct SFN)/stream->fat->fatInfo.bytes_per_sector;
-    sectorNumber+=(stream->fatChain->clusters[clusterNumber]-2)*stream->fat->fatInfo.sectors_per_clusters;
+    sectorNumber+=pvolume->fatInfo.size_of_reserved_area;
+    sectorNumber+=pvolume->fatInfo.size_of_fat*pvolume->fatInfo.number_of_fats;
+    sectorNumber+=pvolume->fatInfo.maximum_number_of_files*(int)sizeof(struct SFN)/pvolume->fatInfo.bytes_per_sector;
+    sectorNumber+=(cluster-2)*pvolume->fatInfo.sectors_per_clusters;
+    return sectorNumber;
+}
+
+int GetFileCluster(struct file_t *stream, void *buffer, int clusterNumber) {
+    int sectorNumber=fat_cluster_sector(stream->fat, stream->fatChain->clusters[clusterNumber]);
     if (disk_read(stream->fat->disk, sectorNumber, buffer,
                   stream->fat->fatInfo.sectors_per_clusters) == -1) {
         errno = ERANGE;
@@ -308,12 +386,14 @@ int GetFileCluster(struct file_t *stream, void *buffer, int clusterNumber) {
 
 
 size_t file_read(void *ptr, size_t size, size_t nmemb, struct file_t *stream) {
+    FAT_TRACE_SCOPE("file_read");
 
     if (!ptr || !stream) {
         errno = EFAULT;
         return -1;
     }
 
+    FAT_TRACE_ARG("position", stream->pos);
     int sizeOfCluster = stream->fat->fatInfo.bytes_per_sector * stream->fat->fatInfo.sectors_per_clusters;
 
     char *tempCluster = malloc(sizeOfCluster);
@@ -362,6 +442,7 @@ size_t file_read(void *ptr, size_t size, size_t nmemb, struct file_t *stream) {
 
 
     free(tempCluster);
+    FAT_TRACE_ARG("bytes", elementCounter * size);
 
 
     return elementCounter;
@@ -381,6 +462,30 @@ int32_t file_seek(struct file_t *stream, int32_t offset, int whence) {
 }
 
 
+void sfn_read_name(const struct SFN *entry, char *name) {
+    int fi=0;
+    for(int i=0;i<11;i++,fi++){
+        if(entry->filename[i]==' '||(i==8&&entry->filename[i+1]!=' ')){
+            if((i==8&&entry->filename[i+1]!=' '))i--;
+            for(int z=i+1;z<11;z++){
+                if(entry->filename[z]!=' '){
+                    name[fi]='.';
+                    fi++;
+                    for(int j=z;j<11;j++){
+                        if(entry->filename[j]==' ')break;
+                        name[fi]=entry->filename[j];
+                        fi++;
+                    }
+                    break;
+                }
+            }
+            break;
+        }
+        name[fi]=entry->filename[i];
+    }
+    name[fi]='\0';
+}
+
 struct dir_t *dir_open(struct volume_t *pvolume, const char *dir_path) {
 
     if(!pvolume||!dir_path){
@@ -404,39 +509,44 @@ struct dir_t *dir_open(struct volume_t *pvolume, const char *dir_path) {
     result->size=pvolume->fatInfo.maximum_number_of_files;
     result->dirData=pvolume->rootDirectory;
     result->readEmptyFiles=0;
+    result->longNames=pvolume->longNames;
 
     return result;
 }
 
 int dir_read(struct dir_t *pdir, struct dir_entry_t *pentry) {
+    FAT_TRACE_SCOPE("dir_read");
 
     if(!pdir||!pentry){
         errno=EFAULT;
         return -1;
     }
+    FAT_TRACE_ARG("position", pdir->pos);
 
 
 
 
     int found=0;
     struct SFN *directory=pdir->dirData;
-    for(;pdir->pos<pdir->size;){
-
-        if(directory[pdir->pos].filename[0]!=0x0&&directory[pdir->pos].filename[0]!=(char)0xe5){
-            if((directory[pdir->pos].size!=0&&pdir->readEmptyFiles==0)||(pdir->readEmptyFiles&&directory[pdir->pos].size==0)) {
-                if (((directory[pdir->pos].file_attributes & (1 << 3)) >> 3) != 1) {
-                    found = 1;
-                }
-            }
-        }
-        pdir->pos++;
-        if(pdir->pos==pdir->size){
+    while(1){
+        if(pdir->pos>=pdir->size){
             if(pdir->readEmptyFiles==0){
                 pdir->readEmptyFiles=1;
                 pdir->pos=0;
+                continue;
             }
+            break;
         }
-        if(found){
+
+        int next=dir_scan_next(directory,pdir->pos,pdir->size);
+        pdir->pos=next+1;
+        if(next==pdir->size){
+            continue;
+        }
+        if((directory[next].size!=0&&pdir->readEmptyFiles==0)||(pdir->readEmptyFiles&&directory[next].size==0)) {
+            directory+=next;
+            pentry->long_name=lfn_table_name(pdir->longNames,next);
+            found=1;
             break;
         }
     }
@@ -445,33 +555,9 @@ int dir_read(struct dir_t *pdir, struct dir_entry_t *pentry) {
     }
 
 
-    directory+=pdir->pos-1;
-
     pentry->size=directory->size;
 
-    {
-        int fi=0;
-        for(int i=0;i<11;i++,fi++){
-            if(directory->filename[i]==' '||(i==8&&directory->filename[i+1]!=' ')){
-                if((i==8&&directory->filename[i+1]!=' '))i--;
-                for(int z=i+1;z<11;z++){
-                    if(directory->filename[z]!=' '){
-                        pentry->name[fi]='.';
-                        fi++;
-                        for(int j=z;j<11;j++){
-                            if(directory->filename[j]==' ')break;
-                            pentry->name[fi]=directory->filename[j];
-                            fi++;
-                        }
-                        break;
-                    }
-                }
-                break;
-            }
-            pentry->name[fi]=directory->filename[i];
-        }
-        pentry->name[fi]='\0';
-    }
+    sfn_read_name(directory,pentry->name);
 
 
     pentry->is_archived= ((directory->file_attributes & ( 1 << 5 )) >> 5)==1;
@@ -3,16 +3,33 @@
 #include "FatStructures.h"
 #include "Fat12Table.h"
 #include <stdio.h>
+#include <sys/types.h>
 #define SECTOR_SIZE 512
 
 
+//A mounted volume never changes its metadata after fat_open and disk_read uses positional reads,
+//so one disk_t/volume_t may be shared by any number of threads without locking.
+//file_t and dir_t carry their own position and must not be shared between threads.
+struct disk_t;
+struct lfn_table_t;
+//Backends other than a plain image file, called after disk_read/disk_write checked the range.
+//close releases backend, diskFD is closed by disk_close
+struct disk_ops_t{
+    int (*read)(struct disk_t* pdisk, int32_t first_sector, void* buffer, int32_t sectors_to_read);
+    int (*write)(struct disk_t* pdisk, int32_t first_sector, const void* buffer, int32_t sectors_to_write);
+    void (*close)(struct disk_t* pdisk);
+};
 struct disk_t{
-    FILE *diskFD;
+    int diskFD; //the image, or the file the backend reads from
     uint32_t numberOfSectors;
+    const struct disk_ops_t *ops; //NULL for a plain image file
+    void *backend;
 };
 struct disk_t* disk_open_from_file(const char* volume_file_name);
 int disk_read(struct disk_t* pdisk, int32_t first_sector, void* buffer, int32_t sectors_to_read);
+int disk_write(struct disk_t* pdisk, int32_t first_sector, const void* buffer, int32_t sectors_to_write); //EROFS without a writable backend
 int disk_close(struct disk_t* pdisk);
+int disk_pread(int fd, void* buffer, size_t size, off_t offset); //whole range or -1
 
 struct volume_t{
     struct disk_t *disk;
@@ -20,11 +37,15 @@ struct volume_t{
     void *FAT1;
     void *FAT2;
     void *rootDirectory;
+    void *index; //mapped sidecar index, NULL when mounted from disk. FAT1, FAT2 and rootDirectory point into it
+    size_t indexSize;
+    struct lfn_table_t *longNames; //long names of the root directory, decoded at mount
 };
 struct volume_t* fat_open(struct disk_t* pdisk, uint32_t first_sector);
 int fat_close(struct volume_t* pvolume);
 
 struct clusters_chain_t *get_chain_fat12( void *  buffer, size_t size, uint16_t first_cluster);
+int32_t fat_cluster_sector(struct volume_t *pvolume, uint16_t cluster); //first sector of a data cluster
 
 struct file_t{
     struct SFN fileInfo;
@@ -32,7 +53,7 @@ struct file_t{
     struct volume_t *fat;
     struct clusters_chain_t *fatChain;
 };
-struct file_t* file_open(struct volume_t* pvolume, const char* file_name);
+struct file_t* file_open(struct volume_t* pvolume, const char* file_name); //8.3 name, or long name in any ASCII case
 int file_close(struct file_t* stream);
 size_t file_read(void *ptr, size_t size, size_t nmemb, struct file_t *stream);
 int32_t file_seek(struct file_t* stream, int32_t offset, int whence);
@@ -42,6 +63,7 @@ struct dir_t{
     int size;
     int pos;
     int readEmptyFiles;
+    const struct lfn_table_t *longNames;
 };
 
 struct dir_entry_t{
@@ -52,10 +74,14 @@ struct dir_entry_t{
     int is_system;
     int is_hidden;
     int is_directory;
+    const char *long_name; //UTF-8 VFAT name, NULL when there is none. Owned by the volume until fat_close
 };
 struct dir_t* dir_open(struct volume_t* pvolume, const char* dir_path);
 int dir_read(struct dir_t* pdir, struct dir_entry_t* pentry);
 int dir_close(struct dir_t* pdir);
 
+//Formats the 8.3 name of entry as NAME.EXT into name (13 bytes)
+void sfn_read_name(const struct SFN *entry, char *name);
+
 
 #endif
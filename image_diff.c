@@ -0,0 +1,499 @@
+#include "image_diff.h"
+#include "parallel.h"
+#include "tree_walk.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define DIFF_CHUNK_CLUSTERS 256
+#define DELTA_COPY_SECTORS 64
+
+
+struct diff_compare_job_t {
+    struct volume_t *volumes[2];
+    uint8_t *changed; //per data cluster
+    uint32_t dataStart;
+    uint32_t clusterCount;
+    int failed;
+};
+
+struct diff_walk_t {
+    struct volume_t *volume; //the volume being walked, target first, then base
+    int *owners; //index into paths for each data cluster, -1 for none
+    uint32_t clusterCount;
+    pthread_mutex_t lock; //guards paths and entries
+    char **paths;
+    struct SFN *entries; //the directory entry behind each path
+    uint32_t pathCount;
+    uint32_t pathCapacity;
+    int failed;
+};
+
+static uint64_t HashBytes(uint64_t hash, const void *data, size_t size) {
+    const uint8_t *bytes = data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static int SameGeometry(struct volume_t *a, struct volume_t *b) {
+    return a->disk->numberOfSectors == b->disk->numberOfSectors &&
+           a->fatInfo.bytes_per_sector == b->fatInfo.bytes_per_sector &&
+           a->fatInfo.sectors_per_clusters == b->fatInfo.sectors_per_clusters &&
+           a->fatInfo.size_of_reserved_area == b->fatInfo.size_of_reserved_area &&
+           a->fatInfo.number_of_fats == b->fatInfo.number_of_fats &&
+           a->fatInfo.maximum_number_of_files == b->fatInfo.maximum_number_of_files &&
+           a->fatInfo.size_of_fat == b->fatInfo.size_of_fat;
+}
+
+//Task i reads chunk i of both images and compares it cluster by cluster, byte for byte
+static void CompareChunk(size_t index, void *context) {
+    struct diff_compare_job_t *job = context;
+    uint32_t first = (uint32_t) index * DIFF_CHUNK_CLUSTERS;
+    uint32_t count = job->clusterCount - first < DIFF_CHUNK_CLUSTERS ? job->clusterCount - first : DIFF_CHUNK_CLUSTERS;
+
+    uint32_t clusterSectors = job->volumes[0]->fatInfo.sectors_per_clusters;
+    size_t clusterBytes = (size_t) clusterSectors * SECTOR_SIZE;
+    int32_t sector = (int32_t) (job->dataStart + first * clusterSectors);
+
+    char *buffers[2] = {malloc(clusterBytes * count), malloc(clusterBytes * count)};
+    int err = !buffers[0] || !buffers[1];
+    for (int image = 0; !err && image < 2; image++)
+        err = disk_read(job->volumes[image]->disk, sector, buffers[image], (int32_t) (count * clusterSectors)) == -1;
+    if (err) {
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+    } else {
+        for (uint32_t i = 0; i < count; i++)
+            job->changed[first + i] = memcmp(buffers[0] + i * clusterBytes, buffers[1] + i * clusterBytes, clusterBytes) != 0;
+    }
+    free(buffers[0]);
+    free(buffers[1]);
+}
+
+static int AddPath(struct diff_walk_t *walk, const char *path, const struct SFN *entry) {
+    char *copy = strdup(path);
+    if (!copy)return -1;
+    pthread_mutex_lock(&walk->lock);
+    if (walk->pathCount == walk->pathCapacity) {
+        uint32_t capacity = walk->pathCapacity ? walk->pathCapacity * 2 : 64;
+        char **paths = realloc(walk->paths, capacity * sizeof(char *));
+        if (paths)walk->paths = paths;
+        struct SFN *entries = paths ? realloc(walk->entries, capacity * sizeof(struct SFN)) : NULL;
+        if (!entries) {
+            pthread_mutex_unlock(&walk->lock);
+            free(copy);
+            return -1;
+        }
+        walk->entries = entries;
+        walk->pathCapacity = capacity;
+    }
+    int result = (int) walk->pathCount;
+    walk->paths[result] = copy;
+    walk->entries[result] = *entry;
+    walk->pathCount++;
+    pthread_mutex_unlock(&walk->lock);
+    return result;
+}
+
+//fat_walk pre callback: records the entry and claims every still unowned cluster of its chain for its path
+static int RecordEntry(const struct fat_walk_entry_t *entry, void *context) {
+    struct diff_walk_t *walk = context;
+    struct volume_t *volume = walk->volume;
+    int owner = AddPath(walk, entry->path, entry->sfn);
+    if (owner == -1) {
+        __atomic_store_n(&walk->failed, 1, __ATOMIC_RELAXED);
+        return FAT_WALK_STOP;
+    }
+    if (entry->sfn->low_order_address_of_first_cluster < 2)return FAT_WALK_CONTINUE;
+    struct clusters_chain_t *chain = get_chain_fat12(volume->FAT1, volume->fatInfo.bytes_per_sector * volume->fatInfo.size_of_fat,
+                                                     entry->sfn->low_order_address_of_first_cluster);
+    if (!chain)return FAT_WALK_CONTINUE;
+
+    for (size_t i = 0; i < chain->size; i++) {
+        uint32_t cluster = chain->clusters[i];
+        int expected = -1;
+        if (cluster >= 2 && cluster - 2 < walk->clusterCount)
+            __atomic_compare_exchange_n(walk->owners + cluster - 2, &expected, owner, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+    free(chain->clusters);
+    free(chain);
+    return FAT_WALK_CONTINUE;
+}
+
+struct diff_path_t {
+    const char *path;
+    int index;
+};
+
+static int ComparePaths(const void *a, const void *b) {
+    return strcmp(((const struct diff_path_t *) a)->path, ((const struct diff_path_t *) b)->path);
+}
+
+static struct diff_path_t *SortedPaths(struct diff_walk_t *walk, uint32_t first, uint32_t count) {
+    struct diff_path_t *result = malloc(sizeof(struct diff_path_t) * (count + 1));
+    if (!result)return NULL;
+    for (uint32_t i = 0; i < count; i++) {
+        result[i].path = walk->paths[first + i];
+        result[i].index = (int) (first + i);
+    }
+    qsort(result, count, sizeof(struct diff_path_t), ComparePaths);
+    return result;
+}
+
+//Merges the two walks by path: entries only in the target, only in the base, or with different bytes
+static int CompareEntries(struct diff_walk_t *walk, uint32_t targetCount, struct image_diff_t *result) {
+    uint32_t baseCount = walk->pathCount - targetCount;
+    struct diff_path_t *target = SortedPaths(walk, 0, targetCount);
+    struct diff_path_t *base = SortedPaths(walk, targetCount, baseCount);
+    result->changedEntries = malloc(sizeof(int) * (walk->pathCount + 1));
+    if (!target || !base || !result->changedEntries) {
+        free(target);
+        free(base);
+        errno = ENOMEM;
+        return 1;
+    }
+
+    uint32_t i = 0, j = 0;
+    while (i < targetCount || j < baseCount) {
+        int order = i == targetCount ? 1 : j == baseCount ? -1 : strcmp(target[i].path, base[j].path);
+        if (order < 0) {
+            result->changedEntries[result->changedEntryCount++] = target[i++].index;
+        } else if (order > 0) {
+            result->changedEntries[result->changedEntryCount++] = base[j++].index;
+        } else {
+            if (memcmp(walk->entries + target[i].index, walk->entries + base[j].index, sizeof(struct SFN)))
+                result->changedEntries[result->changedEntryCount++] = target[i].index;
+            i++;
+            j++;
+        }
+    }
+    free(target);
+    free(base);
+    return 0;
+}
+
+//Continues hash over sectors [first, first + count)
+static int ReadSectorHash(struct disk_t *pdisk, uint32_t first, uint32_t count, uint64_t *hash) {
+    char sector[SECTOR_SIZE];
+    for (uint32_t i = 0; i < count; i++) {
+        if (disk_read(pdisk, (int32_t) (first + i), sector, 1) == -1) {
+            errno = EIO;
+            return 1;
+        }
+        *hash = HashBytes(*hash, sector, SECTOR_SIZE);
+    }
+    return 0;
+}
+
+
+struct image_diff_t *image_diff(struct volume_t *base, struct volume_t *target, int threads) {
+    if (!base || !target) {
+        errno = EFAULT;
+        return NULL;
+    }
+    if (!SameGeometry(base, target) || base->fatInfo.bytes_per_sector != SECTOR_SIZE) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct image_diff_t *result = calloc(1, sizeof(struct image_diff_t));
+    if (!result) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    result->numberOfSectors = target->disk->numberOfSectors;
+    result->dataStart = fat_cluster_sector(target, 2);
+    uint32_t clusterSectors = target->fatInfo.sectors_per_clusters;
+    if (result->dataStart < result->numberOfSectors && clusterSectors) {
+        result->clusterCount = (result->numberOfSectors - result->dataStart) / clusterSectors;
+    }
+    uint32_t dataEnd = result->dataStart + result->clusterCount * clusterSectors;
+    uint32_t rawSectors = result->dataStart + (result->numberOfSectors - dataEnd);
+
+    struct diff_compare_job_t job;
+    memset(&job, 0, sizeof(job));
+    job.volumes[0] = base;
+    job.volumes[1] = target;
+    job.dataStart = result->dataStart;
+    job.clusterCount = result->clusterCount;
+    job.changed = malloc(result->clusterCount + 1);
+
+    result->changedSectors = malloc(sizeof(uint32_t) * (rawSectors + 1));
+    result->changedClusters = malloc(sizeof(uint16_t) * (result->clusterCount + 1));
+    result->clusterOwners = malloc(sizeof(int) * (result->clusterCount + 1));
+    struct diff_walk_t walk;
+    memset(&walk, 0, sizeof(walk));
+    walk.clusterCount = result->clusterCount;
+    walk.owners = malloc(sizeof(int) * (result->clusterCount + 1));
+
+    int err = !job.changed || !result->changedSectors || !result->changedClusters || !result->clusterOwners ||
+              !walk.owners;
+    if (err)errno = ENOMEM;
+    int locked = !err && !pthread_mutex_init(&walk.lock, NULL);
+    if (!err && !locked)err = 1;
+
+    if (!err) {
+        parallel_for((result->clusterCount + DIFF_CHUNK_CLUSTERS - 1) / DIFF_CHUNK_CLUSTERS, threads, CompareChunk, &job);
+        if (job.failed) {
+            errno = EIO;
+            err = 1;
+        }
+    }
+
+    char sectorA[SECTOR_SIZE], sectorB[SECTOR_SIZE];
+    for (uint32_t i = 0; !err && i < rawSectors; i++) {
+        uint32_t sector = i < result->dataStart ? i : dataEnd + (i - result->dataStart);
+        if (disk_read(base->disk, (int32_t) sector, sectorA, 1) == -1 ||
+            disk_read(target->disk, (int32_t) sector, sectorB, 1) == -1) {
+            errno = EIO;
+            err = 1;
+            break;
+        }
+        if (memcmp(sectorA, sectorB, SECTOR_SIZE))result->changedSectors[result->changedSectorCount++] = sector;
+    }
+
+    //clusters are owned by the target's files first, what is left by the files they replaced
+    uint32_t targetCount = 0;
+    if (!err) {
+        for (uint32_t i = 0; i < result->clusterCount; i++)walk.owners[i] = -1;
+        struct fat_walk_options_t options = {RecordEntry, NULL, &walk, 0, threads};
+        for (int i = 0; !err && i < 2; i++) {
+            walk.volume = i ? base : target;
+            err = fat_walk(walk.volume, &options) != 0;
+            if (err && walk.failed)errno = ENOMEM;
+            if (!i)targetCount = walk.pathCount;
+        }
+    }
+    if (!err)err = CompareEntries(&walk, targetCount, result);
+
+    if (!err) {
+        for (uint32_t i = 0; i < result->clusterCount; i++) {
+            if (!job.changed[i])continue;
+            result->changedClusters[result->changedClusterCount] = (uint16_t) (i + 2);
+            result->clusterOwners[result->changedClusterCount] = walk.owners[i];
+            result->changedClusterCount++;
+        }
+    }
+
+    free(job.changed);
+    free(walk.owners);
+    free(walk.entries);
+    if (locked)pthread_mutex_destroy(&walk.lock);
+    result->paths = walk.paths;
+    result->pathCount = walk.pathCount;
+    if (err) {
+        image_diff_free(result);
+        return NULL;
+    }
+
+    return result;
+}
+
+void image_diff_free(struct image_diff_t *diff) {
+    if (!diff)return;
+    free(diff->changedSectors);
+    free(diff->changedEntries);
+    free(diff->changedClusters);
+    free(diff->clusterOwners);
+    for (uint32_t i = 0; i < diff->pathCount; i++)free(diff->paths[i]);
+    free(diff->paths);
+    free(diff);
+}
+
+//Also continues the base and target hashes over the record's sectors, so the delta is tied to the
+//exact contents it replaces and to the contents it leaves behind
+static int WriteRecord(FILE *out, struct volume_t *base, struct volume_t *target, uint32_t firstSector,
+                       uint32_t sectorCount, char *buffer, struct image_delta_header_t *header) {
+    struct image_delta_record_t record = {firstSector, sectorCount};
+    if (fwrite(&record, sizeof(record), 1, out) != 1)return 1;
+    uint64_t baseHash = header->baseHash;
+    if (ReadSectorHash(base->disk, firstSector, sectorCount, &baseHash))return 1;
+    header->baseHash = baseHash;
+    while (sectorCount) {
+        uint32_t count = sectorCount < DELTA_COPY_SECTORS ? sectorCount : DELTA_COPY_SECTORS;
+        if (disk_read(target->disk, (int32_t) firstSector, buffer, (int32_t) count) == -1)return 1;
+        if (fwrite(buffer, SECTOR_SIZE, count, out) != count)return 1;
+        header->targetHash = HashBytes(header->targetHash, buffer, (size_t) count * SECTOR_SIZE);
+        firstSector += count;
+        sectorCount -= count;
+    }
+    return 0;
+}
+
+int image_delta_write(struct image_diff_t *diff, struct volume_t *base, struct volume_t *target,
+                      const char *delta_file_name) {
+    if (!diff || !base || !target || !delta_file_name) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    struct image_delta_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, IMAGE_DELTA_MAGIC, sizeof(header.magic));
+    header.version = IMAGE_DELTA_VERSION;
+    header.numberOfSectors = diff->numberOfSectors;
+    header.metadataSectors = diff->dataStart;
+    uint64_t baseHash = 14695981039346656037ull, targetHash = 14695981039346656037ull;
+    if (ReadSectorHash(base->disk, 0, diff->dataStart, &baseHash) ||
+        ReadSectorHash(target->disk, 0, diff->dataStart, &targetHash))
+        return -1;
+    header.baseHash = baseHash;
+    header.targetHash = targetHash;
+
+    char *buffer = malloc(DELTA_COPY_SECTORS * SECTOR_SIZE);
+    FILE *out = fopen(delta_file_name, "wb");
+    if (!buffer || !out) {
+        if (out)fclose(out);
+        free(buffer);
+        if (!buffer)errno = ENOMEM;
+        return -1;
+    }
+
+    //header is rewritten with the final record count at the end
+    int err = fwrite(&header, sizeof(header), 1, out) != 1;
+
+    uint32_t clusterSectors = target->fatInfo.sectors_per_clusters;
+    for (uint32_t i = 0; !err && i < diff->changedSectorCount;) {
+        uint32_t j = i + 1;
+        while (j < diff->changedSectorCount && diff->changedSectors[j] == diff->changedSectors[j - 1] + 1)j++;
+        err = WriteRecord(out, base, target, diff->changedSectors[i], j - i, buffer, &header);
+        header.recordCount++;
+        i = j;
+    }
+    for (uint32_t i = 0; !err && i < diff->changedClusterCount;) {
+        uint32_t j = i + 1;
+        while (j < diff->changedClusterCount && diff->changedClusters[j] == diff->changedClusters[j - 1] + 1)j++;
+        uint32_t firstSector = diff->dataStart + (diff->changedClusters[i] - 2) * clusterSectors;
+        err = WriteRecord(out, base, target, firstSector, (j - i) * clusterSectors, buffer, &header);
+        header.recordCount++;
+        i = j;
+    }
+
+    if (!err)err = fseek(out, 0, SEEK_SET) || fwrite(&header, sizeof(header), 1, out) != 1;
+    if (fclose(out))err = 1;
+    free(buffer);
+    if (err) {
+        remove(delta_file_name);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int ImageRangeHash(int fd, uint32_t first, uint32_t count, uint64_t *hash) {
+    char sector[SECTOR_SIZE];
+    for (uint32_t i = 0; i < count; i++) {
+        if (pread(fd, sector, SECTOR_SIZE, (off_t) (first + i) * SECTOR_SIZE) != SECTOR_SIZE) {
+            errno = EIO;
+            return 1;
+        }
+        *hash = HashBytes(*hash, sector, SECTOR_SIZE);
+    }
+    return 0;
+}
+
+//Hash of the metadata sectors and every sector the delta's records cover, as they are in the image now.
+//Also checks every record's range and length. Skips over the record data and leaves in positioned after the header
+static int DeltaRangesHash(FILE *in, int fd, const struct image_delta_header_t *header, uint64_t *hash) {
+    *hash = 14695981039346656037ull;
+    if (fseeko(in, sizeof(struct image_delta_header_t), SEEK_SET))return 1;
+    if (ImageRangeHash(fd, 0, header->metadataSectors, hash))return 1;
+    for (uint32_t i = 0; i < header->recordCount; i++) {
+        struct image_delta_record_t record;
+        if (fread(&record, sizeof(record), 1, in) != 1 ||
+            (uint64_t) record.firstSector + record.sectorCount > header->numberOfSectors ||
+            fseeko(in, (off_t) record.sectorCount * SECTOR_SIZE, SEEK_CUR)) {
+            errno = EINVAL;
+            return 1;
+        }
+        if (ImageRangeHash(fd, record.firstSector, record.sectorCount, hash))return 1;
+    }
+    //the records must account for the whole file, so a truncated delta fails before anything is written
+    struct stat info;
+    if (fstat(fileno(in), &info) || ftello(in) != info.st_size) {
+        errno = EINVAL;
+        return 1;
+    }
+    return fseeko(in, sizeof(struct image_delta_header_t), SEEK_SET);
+}
+
+int image_delta_apply(const char *image_file_name, const char *delta_file_name) {
+    if (!image_file_name || !delta_file_name) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    FILE *in = fopen(delta_file_name, "rb");
+    if (!in)return -1;
+    int fd = open(image_file_name, O_RDWR);
+    if (fd == -1) {
+        fclose(in);
+        return -1;
+    }
+
+    struct image_delta_header_t header;
+    uint64_t hash;
+    off_t imageSize = lseek(fd, 0, SEEK_END);
+    int err = fread(&header, sizeof(header), 1, in) != 1 ||
+              memcmp(header.magic, IMAGE_DELTA_MAGIC, sizeof(header.magic)) ||
+              header.version != IMAGE_DELTA_VERSION ||
+              imageSize / SECTOR_SIZE != header.numberOfSectors;
+    if (err)errno = EINVAL;
+    //nothing is written unless the image holds exactly what the delta was made against
+    if (!err) {
+        err = DeltaRangesHash(in, fd, &header, &hash);
+        if (!err && hash != header.baseHash) {
+            errno = EINVAL;
+            err = 1;
+        }
+    }
+
+    char *buffer = err ? NULL : malloc(DELTA_COPY_SECTORS * SECTOR_SIZE);
+    if (!err && !buffer) {
+        errno = ENOMEM;
+        err = 1;
+    }
+
+    for (uint32_t i = 0; !err && i < header.recordCount; i++) {
+        struct image_delta_record_t record;
+        if (fread(&record, sizeof(record), 1, in) != 1 ||
+            (uint64_t) record.firstSector + record.sectorCount > header.numberOfSectors) {
+            errno = EINVAL;
+            err = 1;
+            break;
+        }
+        while (record.sectorCount) {
+            uint32_t count = record.sectorCount < DELTA_COPY_SECTORS ? record.sectorCount : DELTA_COPY_SECTORS;
+            if (fread(buffer, SECTOR_SIZE, count, in) != count) {
+                errno = EINVAL;
+                err = 1;
+                break;
+            }
+            if (pwrite(fd, buffer, (size_t) count * SECTOR_SIZE, (off_t) record.firstSector * SECTOR_SIZE) !=
+                (ssize_t) count * SECTOR_SIZE) {
+                err = 1;
+                break;
+            }
+            record.firstSector += count;
+            record.sectorCount -= count;
+        }
+    }
+
+    if (!err && (fsync(fd) || DeltaRangesHash(in, fd, &header, &hash) || hash != header.targetHash)) {
+        errno = EIO;
+        err = 1;
+    }
+
+    free(buffer);
+    close(fd);
+    fclose(in);
+
+    return err ? -1 : 0;
+}
@@ -0,0 +1,46 @@
+#ifndef FAT_IMAGE_DIFF_H
+#define FAT_IMAGE_DIFF_H
+#include "file_reader.h"
+
+#define IMAGE_DELTA_MAGIC "FATDLT01"
+#define IMAGE_DELTA_VERSION 2
+
+struct image_diff_t {
+    uint32_t numberOfSectors;
+    uint32_t dataStart; //first sector of cluster 2
+    uint32_t clusterCount; //data clusters compared
+    uint32_t *changedSectors; //sectors outside the data clusters: boot sector, FATs, root directory, tail
+    uint32_t changedSectorCount;
+    int *changedEntries; //index into paths of entries added, removed or changed anywhere in the tree
+    uint32_t changedEntryCount;
+    uint16_t *changedClusters; //clusters whose bytes differ
+    int *clusterOwners; //index into paths for each changed cluster (target first, then base), -1 for none
+    uint32_t changedClusterCount;
+    char **paths; //"\\DIR\\FILE.TXT" of every entry of the target's walk, then of the base's
+    uint32_t pathCount;
+};
+
+//Delta file: header, then recordCount records each followed by sectorCount sectors of target data
+struct __attribute__((__packed__)) image_delta_header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t numberOfSectors;
+    uint32_t metadataSectors;
+    uint64_t baseHash; //FNV-1a of sectors [0, metadataSectors), then of every record's sectors in order,
+    uint64_t targetHash; //before and after applying
+    uint32_t recordCount;
+};
+
+struct __attribute__((__packed__)) image_delta_record_t {
+    uint32_t firstSector;
+    uint32_t sectorCount;
+};
+
+struct image_diff_t *image_diff(struct volume_t *base, struct volume_t *target, int threads);
+void image_diff_free(struct image_diff_t *diff);
+
+int image_delta_write(struct image_diff_t *diff, struct volume_t *base, struct volume_t *target,
+                      const char *delta_file_name);
+int image_delta_apply(const char *image_file_name, const char *delta_file_name);
+
+#endif
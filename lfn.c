@@ -0,0 +1,184 @@
+#include "lfn.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+
+
+uint8_t lfn_checksum(const char *name11) {
+    uint8_t sum = 0;
+    for (int i = 0; i < 11; i++)sum = (uint8_t) (((sum & 1) << 7) + (sum >> 1) + (uint8_t) name11[i]);
+    return sum;
+}
+
+static void CopyUnits(const struct LFN *part, uint16_t *units) {
+    for (int i = 0; i < 5; i++)units[i] = part->name_1[i];
+    for (int i = 0; i < 6; i++)units[5 + i] = part->name_2[i];
+    for (int i = 0; i < 2; i++)units[11 + i] = part->name_3[i];
+}
+
+//UCS-2 (surrogate pairs included) to UTF-8, stops at the terminator or the 0xffff padding
+static size_t EncodeUtf8(const uint16_t *units, int count, char *out) {
+    size_t length = 0;
+    for (int i = 0; i < count && units[i] && units[i] != 0xffff; i++) {
+        uint32_t c = units[i];
+        if (c >= 0xd800 && c < 0xdc00 && i + 1 < count && units[i + 1] >= 0xdc00 && units[i + 1] < 0xe000)
+            c = 0x10000 + ((c - 0xd800) << 10) + (units[++i] - 0xdc00);
+        else if (c >= 0xd800 && c < 0xe000)c = '?';
+
+        if (c < 0x80) {
+            out[length++] = (char) c;
+        } else if (c < 0x800) {
+            out[length++] = (char) (0xc0 | c >> 6);
+            out[length++] = (char) (0x80 | (c & 0x3f));
+        } else if (c < 0x10000) {
+            out[length++] = (char) (0xe0 | c >> 12);
+            out[length++] = (char) (0x80 | (c >> 6 & 0x3f));
+            out[length++] = (char) (0x80 | (c & 0x3f));
+        } else {
+            out[length++] = (char) (0xf0 | c >> 18);
+            out[length++] = (char) (0x80 | (c >> 12 & 0x3f));
+            out[length++] = (char) (0x80 | (c >> 6 & 0x3f));
+            out[length++] = (char) (0x80 | (c & 0x3f));
+        }
+    }
+    out[length] = '\0';
+    return length;
+}
+
+static char FoldCase(char c) {
+    return c >= 'A' && c <= 'Z' ? (char) (c - 'A' + 'a') : c;
+}
+
+static uint32_t HashName(const char *name) {
+    uint32_t hash = 2166136261u;
+    for (; *name; name++) {
+        hash ^= (uint8_t) FoldCase(*name);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static int SameName(const char *a, const char *b) {
+    for (; *a && FoldCase(*a) == FoldCase(*b); a++, b++);
+    return FoldCase(*a) == FoldCase(*b);
+}
+
+
+struct lfn_table_t *lfn_table_build(const struct SFN *entries, int count) {
+    if (!entries || count < 0) {
+        errno = EFAULT;
+        return NULL;
+    }
+
+    struct lfn_table_t *result = calloc(1, sizeof(struct lfn_table_t));
+    if (!result) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    result->count = count;
+    result->nameOffset = calloc(count ? count : 1, sizeof(uint32_t));
+    result->next = malloc(sizeof(int32_t) * (count ? count : 1));
+    if (!result->nameOffset || !result->next) {
+        lfn_table_free(result);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    //parts arrive highest order first, each lands in its own slot of units so nothing is revisited
+    uint16_t units[LFN_MAX_ENTRIES * LFN_CHARS_PER_ENTRY];
+    int expected = -1; //order of the next part, 0 once the name is complete, -1 outside a sequence
+    int parts = 0;
+    uint8_t checksum = 0;
+    size_t namesSize = 0, namesCapacity = 0;
+    int named = 0;
+
+    for (int i = 0; i < count; i++) {
+        const struct SFN *entry = entries + i;
+        uint8_t first = (uint8_t) entry->filename[0];
+        if (first == 0x0 || first == 0xe5) {
+            expected = -1;
+            continue;
+        }
+
+        if (entry->file_attributes == 0x0f) {
+            const struct LFN *part = (const void *) entry;
+            int order = part->order & 0x3f;
+            if (part->order & 0x40) {
+                expected = order >= 1 && order <= LFN_MAX_ENTRIES ? order : -1;
+                parts = order;
+                checksum = part->checksum;
+            } else if (order != expected || order == 0 || part->checksum != checksum) {
+                expected = -1;
+            }
+            if (expected > 0) {
+                CopyUnits(part, units + (order - 1) * LFN_CHARS_PER_ENTRY);
+                expected--;
+            }
+            continue;
+        }
+
+        int complete = expected == 0 && !(entry->file_attributes & (1 << 3)) && lfn_checksum(entry->filename) == checksum;
+        expected = -1;
+        if (!complete)continue;
+
+        if (namesCapacity - namesSize < LFN_NAME_MAX) {
+            size_t capacity = namesCapacity ? namesCapacity * 2 : LFN_NAME_MAX * 4;
+            char *names = realloc(result->names, capacity);
+            if (!names) {
+                lfn_table_free(result);
+                errno = ENOMEM;
+                return NULL;
+            }
+            result->names = names;
+            namesCapacity = capacity;
+        }
+        size_t length = EncodeUtf8(units, parts * LFN_CHARS_PER_ENTRY, result->names + namesSize);
+        if (!length)continue;
+        result->nameOffset[i] = (uint32_t) namesSize + 1;
+        namesSize += length + 1;
+        named++;
+    }
+
+    uint32_t bucketCount = 1;
+    while (bucketCount < (uint32_t) named * 2)bucketCount *= 2;
+    result->bucketMask = bucketCount - 1;
+    result->buckets = malloc(sizeof(int32_t) * bucketCount);
+    if (!result->buckets) {
+        lfn_table_free(result);
+        errno = ENOMEM;
+        return NULL;
+    }
+    memset(result->buckets, 0xff, sizeof(int32_t) * bucketCount);
+    //inserted backwards so every bucket lists its entries in directory order
+    for (int i = count - 1; i >= 0; i--) {
+        if (!result->nameOffset[i])continue;
+        uint32_t bucket = HashName(result->names + result->nameOffset[i] - 1) & result->bucketMask;
+        result->next[i] = result->buckets[bucket];
+        result->buckets[bucket] = i;
+    }
+
+    return result;
+}
+
+void lfn_table_free(struct lfn_table_t *table) {
+    if (!table)return;
+    free(table->nameOffset);
+    free(table->names);
+    free(table->buckets);
+    free(table->next);
+    free(table);
+}
+
+const char *lfn_table_name(const struct lfn_table_t *table, int entry) {
+    if (!table || entry < 0 || entry >= table->count || !table->nameOffset[entry])return NULL;
+    return table->names + table->nameOffset[entry] - 1;
+}
+
+int lfn_table_find(const struct lfn_table_t *table, const char *name) {
+    if (!table || !name)return -1;
+    for (int32_t i = table->buckets[HashName(name) & table->bucketMask]; i != -1; i = table->next[i]) {
+        if (SameName(table->names + table->nameOffset[i] - 1, name))return i;
+    }
+    return -1;
+}
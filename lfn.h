@@ -0,0 +1,33 @@
+#ifndef FAT_LFN_H
+#define FAT_LFN_H
+#include "FatStructures.h"
+
+#define LFN_CHARS_PER_ENTRY 13
+#define LFN_MAX_ENTRIES 20
+#define LFN_NAME_MAX (LFN_MAX_ENTRIES * LFN_CHARS_PER_ENTRY * 3 + 1) //longest UTF-8 name, terminator included
+
+//Long names of one directory, keyed by the index of the SFN entry they belong to.
+//Names are UTF-8 in one pool, lookups hash them with ASCII case folding
+struct lfn_table_t {
+    int count; //entries of the directory
+    uint32_t *nameOffset; //per entry, offset into names + 1, 0 when the entry has no long name
+    char *names;
+    int32_t *buckets; //first entry of each hash bucket, -1 when empty
+    int32_t *next; //per entry, next entry in the same bucket
+    uint32_t bucketMask;
+};
+
+//Checksum of an 8.3 name that every LFN entry of its long name repeats
+uint8_t lfn_checksum(const char *name11);
+
+//Decodes the long names of any directory entry array in one forward pass. Sequences that are out of
+//order, interrupted or fail the checksum are dropped, the SFN then simply has no long name
+struct lfn_table_t *lfn_table_build(const struct SFN *entries, int count);
+void lfn_table_free(struct lfn_table_t *table);
+
+//Long name of entry, NULL when it has none
+const char *lfn_table_name(const struct lfn_table_t *table, int entry);
+//Entry whose long name matches name ignoring ASCII case, -1 when there is none
+int lfn_table_find(const struct lfn_table_t *table, const char *name);
+
+#endif
@@ -0,0 +1,62 @@
+#include "parallel.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+
+
+struct parallel_job_t {
+    size_t next;
+    size_t count;
+    parallel_task_t task;
+    void *context;
+};
+
+static void *ParallelWorker(void *arg) {
+    struct parallel_job_t *job = arg;
+    for (size_t i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED); i < job->count;
+         i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) {
+        job->task(i, job->context);
+    }
+    return NULL;
+}
+
+int parallel_thread_count(int threads) {
+    if (threads > 0)return threads;
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    return online > 0 ? (int) online : 1;
+}
+
+int parallel_for(size_t count, int threads, parallel_task_t task, void *context) {
+    if (!task) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    struct parallel_job_t job = {0, count, task, context};
+    threads = parallel_thread_count(threads);
+    if ((size_t) threads > count)threads = (int) count;
+    if (threads <= 1) {
+        ParallelWorker(&job);
+        return 0;
+    }
+
+    pthread_t *workers = malloc(sizeof(pthread_t) * (threads - 1));
+    if (!workers) {
+        ParallelWorker(&job);
+        return 0;
+    }
+
+    int started = 0;
+    for (; started < threads - 1; started++) {
+        if (pthread_create(workers + started, NULL, ParallelWorker, &job))break;
+    }
+    ParallelWorker(&job);
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+
+    return 0;
+}
@@ -0,0 +1,12 @@
+#ifndef FAT_PARALLEL_H
+#define FAT_PARALLEL_H
+#include <stddef.h>
+
+typedef void (*parallel_task_t)(size_t index, void *context);
+
+//Runs task(i, context) for every i in [0, count) on up to threads threads (0 = one per online CPU).
+//Indexes are handed out dynamically, the call returns when all of them are done
+int parallel_for(size_t count, int threads, parallel_task_t task, void *context);
+int parallel_thread_count(int threads);
+
+#endif
@@ -0,0 +1,433 @@
+#include "recover.h"
+#include "parallel.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+
+
+struct signature_t {
+    const char *magic;
+    size_t magicLength;
+    const char *type;
+    const char *extension;
+    const char *footer; //NULL when the format has no end marker
+    size_t footerLength;
+    size_t footerExtra; //bytes that still belong to the file after the marker
+    int lastFooter; //formats that append updates end at the last marker, not the first
+};
+
+static const struct signature_t signatures[] = {
+        {"\xff\xd8\xff", 3, "JPEG image", "jpg", "\xff\xd9", 2, 0, 0},
+        {"\x89PNG\r\n\x1a\n", 8, "PNG image", "png", "IEND", 4, 4, 0},
+        {"%PDF-", 5, "PDF document", "pdf", "%%EOF", 5, 0, 1},
+        {"GIF87a", 6, "GIF image", "gif", "\x00\x3b", 2, 0, 0},
+        {"GIF89a", 6, "GIF image", "gif", "\x00\x3b", 2, 0, 0},
+        {"PK\x03\x04", 4, "ZIP archive", "zip", NULL, 0, 0, 0},
+        {"\x7f" "ELF", 4, "ELF executable", "elf", NULL, 0, 0, 0},
+        {"\x1f\x8b\x08", 3, "gzip stream", "gz", NULL, 0, 0, 0},
+};
+#define SIGNATURE_COUNT (sizeof(signatures) / sizeof(signatures[0]))
+
+struct carve_chunk_t {
+    struct carved_file_t *hits;
+    size_t count;
+    size_t capacity;
+};
+
+struct recover_scan_t {
+    struct volume_t *volume;
+    size_t clusterBytes;
+    uint32_t limit; //one past the last usable cluster number
+    uint8_t *entered; //per cluster, deleted directories already listed
+    int error; //first errno of any thread
+
+    pthread_mutex_t lock; //guards files
+    struct recovered_file_t *files;
+    size_t fileCount;
+    size_t fileCapacity;
+
+    struct carve_chunk_t *chunks;
+};
+
+static uint32_t ClusterLimit(struct volume_t *pvolume) {
+    uint32_t dataStart = fat_cluster_sector(pvolume, 2);
+    uint32_t clusters = 0;
+    if (pvolume->disk->numberOfSectors > dataStart && pvolume->fatInfo.sectors_per_clusters)
+        clusters = (pvolume->disk->numberOfSectors - dataStart) / pvolume->fatInfo.sectors_per_clusters;
+    uint32_t fatEntries = pvolume->fatInfo.bytes_per_sector * pvolume->fatInfo.size_of_fat / 3 * 2;
+    if (clusters + 2 > fatEntries)clusters = fatEntries > 2 ? fatEntries - 2 : 0;
+    return clusters + 2;
+}
+
+static int IsFree(const struct recover_scan_t *scan, uint32_t cluster) {
+    return cluster >= 2 && cluster < scan->limit && TableValue((uint16_t) cluster, scan->volume->FAT1) == 0;
+}
+
+static void SetError(struct recover_scan_t *scan, int error) {
+    int expected = 0;
+    __atomic_compare_exchange_n(&scan->error, &expected, error, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+//The usual undelete guess: the first cluster, then the next free clusters in order until the size is covered
+static void GuessRun(const struct recover_scan_t *scan, struct recovered_file_t *file) {
+    uint16_t first = file->entry.low_order_address_of_first_cluster;
+    size_t need = file->is_directory ? 1 : (file->entry.size + scan->clusterBytes - 1) / scan->clusterBytes;
+    file->clusters = NULL;
+    file->clusterCount = 0;
+
+    if (first < 2 || first >= scan->limit || !need) {
+        file->state = RECOVER_EMPTY;
+        return;
+    }
+    if (!IsFree(scan, first)) {
+        file->state = RECOVER_OVERWRITTEN;
+        return;
+    }
+
+    file->clusters = malloc(need * sizeof(uint16_t));
+    if (!file->clusters) {
+        file->state = RECOVER_EMPTY;
+        return;
+    }
+    file->state = RECOVER_CONTIGUOUS;
+    file->clusters[file->clusterCount++] = first;
+    for (uint32_t cluster = first + 1; file->clusterCount < need && cluster < scan->limit; cluster++) {
+        if (IsFree(scan, cluster))file->clusters[file->clusterCount++] = (uint16_t) cluster;
+        else file->state = RECOVER_FRAGMENTED;
+    }
+    if (file->clusterCount < need)file->state = RECOVER_FRAGMENTED;
+}
+
+static void ScanEntries(struct recover_scan_t *scan, const struct SFN *entries, size_t count, const char *parent,
+                        int inDeleted);
+
+//A deleted directory whose first cluster is still free: its entries are lost with it, live ones included.
+//Only that cluster is listed, the rest of the chain is gone with the FAT entries
+static void ScanDeletedDirectory(struct recover_scan_t *scan, uint16_t cluster, const char *path) {
+    if (__atomic_exchange_n(scan->entered + cluster, 1, __ATOMIC_RELAXED))return;
+
+    struct volume_t *volume = scan->volume;
+    char *data = malloc(scan->clusterBytes);
+    if (!data) {
+        SetError(scan, ENOMEM);
+        return;
+    }
+    if (disk_read(volume->disk, fat_cluster_sector(volume, cluster), data, volume->fatInfo.sectors_per_clusters) == -1)
+        SetError(scan, errno);
+    else
+        ScanEntries(scan, (const struct SFN *) data, scan->clusterBytes / sizeof(struct SFN), path, 1);
+    free(data);
+}
+
+static void ScanEntries(struct recover_scan_t *scan, const struct SFN *entries, size_t count, const char *parent,
+                        int inDeleted) {
+    for (size_t i = 0; i < count && !__atomic_load_n(&scan->error, __ATOMIC_RELAXED); i++) {
+        const struct SFN *entry = entries + i;
+        if (entry->filename[0] == 0x0)break;
+        int deleted = entry->filename[0] == (char) 0xe5;
+        if ((!deleted && !inDeleted) || entry->filename[0] == '.' || entry->file_attributes == 0x0f ||
+            (entry->file_attributes & (1 << 3)))
+            continue;
+
+        struct recovered_file_t file;
+        char name[13];
+        file.entry = *entry;
+        if (deleted)file.entry.filename[0] = '_';
+        sfn_read_name(&file.entry, name);
+        if (snprintf(file.path, sizeof(file.path), "%s\\%s", parent, name) >= (int) sizeof(file.path)) {
+            SetError(scan, ENAMETOOLONG);
+            return;
+        }
+        file.is_directory = (entry->file_attributes & (1 << 4)) != 0;
+        GuessRun(scan, &file);
+
+        pthread_mutex_lock(&scan->lock);
+        if (scan->fileCount == scan->fileCapacity) {
+            size_t capacity = scan->fileCapacity ? scan->fileCapacity * 2 : 16;
+            struct recovered_file_t *grown = realloc(scan->files, capacity * sizeof(struct recovered_file_t));
+            if (!grown) {
+                pthread_mutex_unlock(&scan->lock);
+                free(file.clusters);
+                SetError(scan, ENOMEM);
+                return;
+            }
+            scan->files = grown;
+            scan->fileCapacity = capacity;
+        }
+        scan->files[scan->fileCount++] = file;
+        pthread_mutex_unlock(&scan->lock);
+
+        if (file.is_directory && file.state == RECOVER_CONTIGUOUS)ScanDeletedDirectory(scan, file.clusters[0], file.path);
+    }
+}
+
+//fat_walk pre callback: lists every live directory once more, this time looking at the deleted entries
+static int ScanDirectory(const struct fat_walk_entry_t *entry, void *context) {
+    struct recover_scan_t *scan = context;
+    if (!entry->is_directory)return FAT_WALK_CONTINUE;
+
+    struct volume_t *volume = scan->volume;
+    struct clusters_chain_t *chain = get_chain_fat12(volume->FAT1, volume->fatInfo.size_of_fat * volume->fatInfo.bytes_per_sector,
+                                                     entry->sfn->low_order_address_of_first_cluster);
+    if (!chain)return FAT_WALK_CONTINUE;
+
+    char *data = malloc(chain->size * scan->clusterBytes);
+    int err = data == NULL;
+    if (err)SetError(scan, ENOMEM);
+    for (size_t i = 0; !err && i < chain->size; i++) {
+        err = disk_read(volume->disk, fat_cluster_sector(volume, chain->clusters[i]), data + i * scan->clusterBytes,
+                        volume->fatInfo.sectors_per_clusters) == -1;
+        if (err)SetError(scan, errno);
+    }
+    if (!err)
+        ScanEntries(scan, (const struct SFN *) data, chain->size * scan->clusterBytes / sizeof(struct SFN), entry->path, 0);
+
+    free(data);
+    free(chain->clusters);
+    free(chain);
+    return __atomic_load_n(&scan->error, __ATOMIC_RELAXED) ? FAT_WALK_STOP : FAT_WALK_CONTINUE;
+}
+
+static const struct signature_t *MatchSignature(const uint8_t *data) {
+    for (size_t i = 0; i < SIGNATURE_COUNT; i++) {
+        if (!memcmp(data, signatures[i].magic, signatures[i].magicLength))return signatures + i;
+    }
+    return NULL;
+}
+
+//One chunk of the data region: reads only its runs of free clusters and checks each cluster's first bytes
+static void CarveChunk(size_t index, void *context) {
+    struct recover_scan_t *scan = context;
+    struct carve_chunk_t *chunk = scan->chunks + index;
+    struct volume_t *volume = scan->volume;
+    uint32_t begin = 2 + (uint32_t) index * RECOVER_CARVE_CHUNK_CLUSTERS;
+    uint32_t end = begin + RECOVER_CARVE_CHUNK_CLUSTERS < scan->limit ? begin + RECOVER_CARVE_CHUNK_CLUSTERS : scan->limit;
+    uint8_t *buffer = NULL;
+
+    for (uint32_t cluster = begin; cluster < end && !__atomic_load_n(&scan->error, __ATOMIC_RELAXED);) {
+        if (!IsFree(scan, cluster)) {
+            cluster++;
+            continue;
+        }
+        uint32_t run = 1;
+        while (cluster + run < end && IsFree(scan, cluster + run))run++;
+
+        if (!buffer && !(buffer = malloc(RECOVER_CARVE_CHUNK_CLUSTERS * scan->clusterBytes))) {
+            SetError(scan, ENOMEM);
+            break;
+        }
+        if (disk_read(volume->disk, fat_cluster_sector(volume, (uint16_t) cluster), buffer,
+                      (int32_t) (run * volume->fatInfo.sectors_per_clusters)) == -1) {
+            SetError(scan, errno);
+            break;
+        }
+
+        for (uint32_t i = 0; i < run; i++) {
+            const struct signature_t *signature = MatchSignature(buffer + i * scan->clusterBytes);
+            if (!signature)continue;
+            if (chunk->count == chunk->capacity) {
+                size_t capacity = chunk->capacity ? chunk->capacity * 2 : 8;
+                struct carved_file_t *grown = realloc(chunk->hits, capacity * sizeof(struct carved_file_t));
+                if (!grown) {
+                    SetError(scan, ENOMEM);
+                    break;
+                }
+                chunk->hits = grown;
+                chunk->capacity = capacity;
+            }
+            struct carved_file_t *hit = chunk->hits + chunk->count++;
+            hit->first_cluster = (uint16_t) (cluster + i);
+            hit->clusters = 1;
+            hit->type = signature->type;
+            hit->extension = signature->extension;
+        }
+        cluster += run;
+    }
+
+    free(buffer);
+}
+
+static int Carve(struct recover_scan_t *scan, struct recovery_report_t *report, int threads) {
+    size_t chunkCount = scan->limit > 2 ? (scan->limit - 2 + RECOVER_CARVE_CHUNK_CLUSTERS - 1) / RECOVER_CARVE_CHUNK_CLUSTERS : 0;
+    scan->chunks = calloc(chunkCount ? chunkCount : 1, sizeof(struct carve_chunk_t));
+    if (!scan->chunks) {
+        errno = ENOMEM;
+        return 1;
+    }
+    parallel_for(chunkCount, threads, CarveChunk, scan);
+
+    size_t total = 0;
+    for (size_t i = 0; i < chunkCount; i++)total += scan->chunks[i].count;
+    report->carved = malloc((total ? total : 1) * sizeof(struct carved_file_t));
+    if (report->carved) {
+        for (size_t i = 0; i < chunkCount; i++) {
+            memcpy(report->carved + report->carvedCount, scan->chunks[i].hits, scan->chunks[i].count * sizeof(struct carved_file_t));
+            report->carvedCount += scan->chunks[i].count;
+        }
+    } else {
+        SetError(scan, ENOMEM);
+    }
+    for (size_t i = 0; i < chunkCount; i++)free(scan->chunks[i].hits);
+    free(scan->chunks);
+    if (scan->error) {
+        errno = scan->error;
+        return 1;
+    }
+
+    //chunks are in cluster order, so each hit extends up to the next one
+    uint32_t maxClusters = (uint32_t) (RECOVER_CARVE_MAX_BYTES / scan->clusterBytes);
+    for (size_t i = 0; i < report->carvedCount; i++) {
+        struct carved_file_t *hit = report->carved + i;
+        uint32_t stop = i + 1 < report->carvedCount ? report->carved[i + 1].first_cluster : scan->limit;
+        for (uint32_t cluster = hit->first_cluster + 1; cluster < stop && hit->clusters < maxClusters && IsFree(scan, cluster); cluster++)
+            hit->clusters++;
+    }
+    return 0;
+}
+
+
+struct recovery_report_t *fat_recover_scan(struct volume_t *pvolume, int threads) {
+    if (!pvolume) {
+        errno = EFAULT;
+        return NULL;
+    }
+
+    struct recovery_report_t *result = calloc(1, sizeof(struct recovery_report_t));
+    if (!result) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    struct recover_scan_t scan;
+    memset(&scan, 0, sizeof(scan));
+    scan.volume = pvolume;
+    scan.clusterBytes = (size_t) pvolume->fatInfo.sectors_per_clusters * SECTOR_SIZE;
+    scan.limit = ClusterLimit(pvolume);
+    scan.entered = calloc(scan.limit, 1);
+    if (!scan.entered) {
+        free(result);
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (pthread_mutex_init(&scan.lock, NULL)) {
+        free(scan.entered);
+        free(result);
+        return NULL;
+    }
+    for (uint32_t cluster = 2; cluster < scan.limit; cluster++)result->freeClusters += IsFree(&scan, cluster);
+
+    ScanEntries(&scan, pvolume->rootDirectory, pvolume->fatInfo.maximum_number_of_files, "", 0);
+    struct fat_walk_options_t walk = {ScanDirectory, NULL, &scan, 0, threads};
+    int err = scan.error || fat_walk(pvolume, &walk) == -1;
+    if (!err && scan.error) {
+        errno = scan.error;
+        err = 1;
+    }
+    result->files = scan.files;
+    result->fileCount = scan.fileCount;
+    if (!err)err = Carve(&scan, result, threads);
+
+    pthread_mutex_destroy(&scan.lock);
+    free(scan.entered);
+    if (err) {
+        int savedErrno = errno;
+        fat_recover_free(result);
+        errno = savedErrno;
+        return NULL;
+    }
+    return result;
+}
+
+void fat_recover_free(struct recovery_report_t *report) {
+    if (!report)return;
+    for (size_t i = 0; i < report->fileCount; i++)free(report->files[i].clusters);
+    free(report->files);
+    free(report->carved);
+    free(report);
+}
+
+
+static int WriteClusters(struct volume_t *pvolume, const uint16_t *clusters, size_t count, uint16_t first,
+                         size_t bytes, FILE *out) {
+    size_t clusterBytes = (size_t) pvolume->fatInfo.sectors_per_clusters * SECTOR_SIZE;
+    char *buffer = malloc(clusterBytes);
+    if (!buffer) {
+        errno = ENOMEM;
+        return -1;
+    }
+    for (size_t i = 0; i < count && bytes; i++) {
+        uint16_t cluster = clusters ? clusters[i] : (uint16_t) (first + i);
+        size_t take = bytes < clusterBytes ? bytes : clusterBytes;
+        if (disk_read(pvolume->disk, fat_cluster_sector(pvolume, cluster), buffer, pvolume->fatInfo.sectors_per_clusters) == -1 ||
+            fwrite(buffer, 1, take, out) != take) {
+            free(buffer);
+            return -1;
+        }
+        bytes -= take;
+    }
+    free(buffer);
+    return 0;
+}
+
+int fat_recover_extract(struct volume_t *pvolume, const struct recovered_file_t *file, const char *output_file_name) {
+    if (!pvolume || !file || !output_file_name) {
+        errno = EFAULT;
+        return -1;
+    }
+    if (!file->clusterCount) {
+        errno = ENODATA;
+        return -1;
+    }
+
+    FILE *out = fopen(output_file_name, "wb");
+    if (!out)return -1;
+    size_t clusterBytes = (size_t) pvolume->fatInfo.sectors_per_clusters * SECTOR_SIZE;
+    size_t bytes = file->is_directory ? clusterBytes : file->entry.size;
+    int err = WriteClusters(pvolume, file->clusters, file->clusterCount, 0, bytes, out);
+    if (fclose(out))err = -1;
+    return err;
+}
+
+static size_t FindFooter(const uint8_t *data, size_t size, const struct signature_t *signature) {
+    size_t found = size;
+    for (size_t i = signature->magicLength; i + signature->footerLength <= size; i++) {
+        if (memcmp(data + i, signature->footer, signature->footerLength))continue;
+        size_t end = i + signature->footerLength + signature->footerExtra;
+        found = end < size ? end : size;
+        if (!signature->lastFooter)break;
+    }
+    return found;
+}
+
+int fat_carve_extract(struct volume_t *pvolume, const struct carved_file_t *carved, const char *output_file_name) {
+    if (!pvolume || !carved || !output_file_name) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    size_t clusterBytes = (size_t) pvolume->fatInfo.sectors_per_clusters * SECTOR_SIZE;
+    size_t size = carved->clusters * clusterBytes;
+    uint8_t *data = malloc(size ? size : 1);
+    if (!data) {
+        errno = ENOMEM;
+        return -1;
+    }
+    //carved runs are consecutive clusters, one read covers them
+    if (disk_read(pvolume->disk, fat_cluster_sector(pvolume, carved->first_cluster), data,
+                  (int32_t) (carved->clusters * pvolume->fatInfo.sectors_per_clusters)) == -1) {
+        free(data);
+        return -1;
+    }
+
+    const struct signature_t *signature = MatchSignature(data);
+    if (signature && signature->footer)size = FindFooter(data, size, signature);
+
+    FILE *out = fopen(output_file_name, "wb");
+    int err = !out || fwrite(data, 1, size, out) != size;
+    if (out && fclose(out))err = 1;
+    free(data);
+    return err ? -1 : 0;
+}
@@ -0,0 +1,54 @@
+#ifndef FAT_RECOVER_H
+#define FAT_RECOVER_H
+#include "file_reader.h"
+#include "tree_walk.h"
+
+#define RECOVER_PATH_LENGTH FAT_WALK_PATH_LENGTH
+#define RECOVER_CARVE_CHUNK_CLUSTERS 256 //clusters per parallel carving task
+#define RECOVER_CARVE_MAX_BYTES (16 << 20) //longest carved file
+
+//How much of a deleted file the guessed cluster run is likely to hold
+#define RECOVER_CONTIGUOUS 0 //first cluster free and the run follows it without gaps
+#define RECOVER_FRAGMENTED 1 //clusters in use by other files had to be skipped
+#define RECOVER_OVERWRITTEN 2 //first cluster belongs to a live file again, nothing to recover
+#define RECOVER_EMPTY 3 //size 0 or no first cluster
+
+//A deleted entry, its first character is lost and shows as '_'. Entries listed from the first cluster of a
+//deleted directory whose run is RECOVER_CONTIGUOUS are reported too, those not marked deleted keep their name
+struct recovered_file_t {
+    char path[RECOVER_PATH_LENGTH];
+    struct SFN entry;
+    int is_directory;
+    int state;
+    uint16_t *clusters; //guessed run, first cluster then the next free ones
+    size_t clusterCount;
+};
+
+struct carved_file_t {
+    uint16_t first_cluster;
+    uint32_t clusters; //free clusters from the signature up to the next signature or cluster in use
+    const char *type;
+    const char *extension;
+};
+
+struct recovery_report_t {
+    struct recovered_file_t *files;
+    size_t fileCount;
+    struct carved_file_t *carved;
+    size_t carvedCount;
+    uint32_t freeClusters;
+};
+
+//Finds deleted entries in every reachable directory (directories in parallel through fat_walk) and in the
+//deleted directories that can still be read, then carves the free clusters of the data region for known
+//signatures in parallel chunks that only read free clusters.
+//Never writes to the disk. threads 0 = one per online CPU
+struct recovery_report_t *fat_recover_scan(struct volume_t *pvolume, int threads);
+void fat_recover_free(struct recovery_report_t *report);
+
+//Writes the guessed run of file, cut to the size in its entry
+int fat_recover_extract(struct volume_t *pvolume, const struct recovered_file_t *file, const char *output_file_name);
+//Writes carved's clusters, cut at the end marker for types that have one (JPEG, PNG, PDF, GIF)
+int fat_carve_extract(struct volume_t *pvolume, const struct carved_file_t *carved, const char *output_file_name);
+
+#endif
@@ -0,0 +1,152 @@
+#include "test.h"
+#include "disk_compressed.h"
+
+//compressed_test <image> <scratch> - the LZ codec on its own, then containers with hole, short,
+//incompressible and compressible chunks read back sector by sector
+
+#define IMAGE_CHUNKS 4
+#define SHORT_TAIL (3 * SECTOR_SIZE) //the last chunk of the crafted image is this long
+
+
+static void CheckRoundTrip(const uint8_t *data, size_t size) {
+    size_t capacity = size + size / 8 + 16;
+    uint8_t *packed = malloc(capacity);
+    uint8_t *unpacked = malloc(size + 1);
+    CHECK(packed && unpacked);
+    if (packed && unpacked) {
+        size_t packedSize = lz_compress(data, size, packed, capacity);
+        CHECK(packedSize > 0 || size == 0);
+        CHECK(lz_decompress(packed, packedSize, unpacked, size) == size);
+        CHECK(memcmp(unpacked, data, size) == 0);
+        //one byte short of room fails instead of writing past it
+        if (size)CHECK(lz_decompress(packed, packedSize, unpacked, size - 1) == 0);
+    }
+    free(packed);
+    free(unpacked);
+}
+
+static void CheckCodec(void) {
+    uint32_t state = 7;
+    uint8_t *data = malloc(DISK_COMPRESSED_CHUNK_SIZE);
+    uint8_t *packed = malloc(DISK_COMPRESSED_CHUNK_SIZE);
+    CHECK(data && packed);
+    if (!data || !packed) {
+        free(data);
+        free(packed);
+        return;
+    }
+
+    //shorter than a match, then just around the minimum match and the 15 byte length nibble
+    for (size_t size = 0; size <= 40; size++) {
+        for (size_t i = 0; i < size; i++)data[i] = (uint8_t) (i % 3);
+        CheckRoundTrip(data, size);
+        for (size_t i = 0; i < size; i++)data[i] = (uint8_t) TestRandom(&state);
+        CheckRoundTrip(data, size);
+    }
+
+    //one byte repeated, a match overlapping its own output with a length that needs extension bytes
+    memset(data, 'x', DISK_COMPRESSED_CHUNK_SIZE);
+    CheckRoundTrip(data, DISK_COMPRESSED_CHUNK_SIZE);
+    CHECK(lz_compress(data, DISK_COMPRESSED_CHUNK_SIZE, packed, DISK_COMPRESSED_CHUNK_SIZE) < 1024);
+
+    //text-like, short matches at many offsets
+    for (size_t i = 0; i < DISK_COMPRESSED_CHUNK_SIZE; i++)data[i] = (uint8_t) ("the quick brown fox "[TestRandom(&state) % 20]);
+    CheckRoundTrip(data, DISK_COMPRESSED_CHUNK_SIZE);
+
+    //incompressible: does not fit in less than its own size, but still round trips with room to spare
+    for (size_t i = 0; i < DISK_COMPRESSED_CHUNK_SIZE; i++)data[i] = (uint8_t) TestRandom(&state);
+    CHECK(lz_compress(data, DISK_COMPRESSED_CHUNK_SIZE, packed, DISK_COMPRESSED_CHUNK_SIZE - 1) == 0);
+    CheckRoundTrip(data, DISK_COMPRESSED_CHUNK_SIZE);
+
+    //a stream cut before its last sequence never yields the whole block, only the closing token is optional
+    memset(data, 'y', 4096);
+    size_t packedSize = lz_compress(data, 4096, packed, DISK_COMPRESSED_CHUNK_SIZE);
+    CHECK(packedSize > 2);
+    for (size_t cut = 0; cut + 1 < packedSize; cut++)CHECK(lz_decompress(packed, cut, data, 4096) != 4096);
+
+    free(data);
+    free(packed);
+}
+
+//Compresses image into scratch and compares every sector read through the container with the raw image.
+//types, when given, counts the chunks of each type in the container's index
+static void CheckContainer(const char *image, const char *container, uint32_t *types) {
+    CHECK(disk_compress_image(image, container) == 0);
+
+    FILE *file = fopen(container, "rb");
+    struct disk_compressed_header_t header;
+    CHECK(file && fread(&header, sizeof(header), 1, file) == 1);
+    if (file && types && fseek(file, (long) header.index_offset, SEEK_SET) == 0) {
+        for (uint32_t i = 0; i < header.chunk_count; i++) {
+            struct disk_chunk_t chunk;
+            CHECK(fread(&chunk, sizeof(chunk), 1, file) == 1);
+            if (chunk.type <= DISK_CHUNK_LZ)types[chunk.type]++;
+        }
+    }
+    if (file)fclose(file);
+
+    struct disk_t *raw = disk_open_from_file(image);
+    struct disk_t *packed = disk_open_compressed(container);
+    CHECK(raw && packed);
+    if (raw && packed) {
+        CHECK(raw->numberOfSectors == packed->numberOfSectors);
+        char expected[8 * SECTOR_SIZE], actual[8 * SECTOR_SIZE];
+        //uneven steps so reads straddle chunk boundaries
+        for (uint32_t sector = 0; sector < raw->numberOfSectors;) {
+            int32_t count = 1 + (int32_t) (sector % 8);
+            if (sector + count > raw->numberOfSectors)count = (int32_t) (raw->numberOfSectors - sector);
+            CHECK(disk_read(raw, (int32_t) sector, expected, count) == count);
+            CHECK(disk_read(packed, (int32_t) sector, actual, count) == count);
+            CHECK(memcmp(expected, actual, (size_t) count * SECTOR_SIZE) == 0);
+            sector += count;
+        }
+        char sector[SECTOR_SIZE];
+        CHECK(disk_read(packed, (int32_t) packed->numberOfSectors, sector, 1) == -1);
+    }
+    if (raw)disk_close(raw);
+    if (packed)disk_close(packed);
+    remove(container);
+}
+
+//Chunks: a hole, random bytes, text, and a short one of repeated sectors
+static int CraftImage(const char *file_name) {
+    size_t size = (IMAGE_CHUNKS - 1) * DISK_COMPRESSED_CHUNK_SIZE + SHORT_TAIL;
+    uint8_t *data = calloc(1, size);
+    if (!data)return 1;
+    uint32_t state = 99;
+    uint8_t *chunk = data + DISK_COMPRESSED_CHUNK_SIZE;
+    for (size_t i = 0; i < DISK_COMPRESSED_CHUNK_SIZE; i++)chunk[i] = (uint8_t) TestRandom(&state);
+    chunk += DISK_COMPRESSED_CHUNK_SIZE;
+    for (size_t i = 0; i < DISK_COMPRESSED_CHUNK_SIZE; i++)chunk[i] = (uint8_t) ("lorem ipsum dolor "[i % 18]);
+    chunk += DISK_COMPRESSED_CHUNK_SIZE;
+    for (size_t i = 0; i < SHORT_TAIL; i++)chunk[i] = (uint8_t) (i % SECTOR_SIZE);
+
+    FILE *file = fopen(file_name, "wb");
+    int err = !file || fwrite(data, size, 1, file) != 1;
+    if (file && fclose(file))err = 1;
+    free(data);
+    return err;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <image> <scratch>\n", argv[0]);
+        return 2;
+    }
+
+    CheckCodec();
+
+    char crafted[4096], container[4096];
+    snprintf(crafted, sizeof(crafted), "%s", TestPath(argv[2], "compressed_crafted.img"));
+    snprintf(container, sizeof(container), "%s", TestPath(argv[2], "compressed.fatlz"));
+    uint32_t types[DISK_CHUNK_LZ + 1] = {0};
+    CHECK(CraftImage(crafted) == 0);
+    CheckContainer(crafted, container, types);
+    CHECK(types[DISK_CHUNK_HOLE] == 1);
+    CHECK(types[DISK_CHUNK_RAW] == 1);
+    CHECK(types[DISK_CHUNK_LZ] == 2);
+    remove(crafted);
+
+    CheckContainer(argv[1], container, NULL);
+    return TestResult();
+}
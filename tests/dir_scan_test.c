@@ -0,0 +1,121 @@
+#include "test.h"
+#include "dir_scan.h"
+
+//dir_scan_test <image> <scratch> - built once per kernel (scalar, SSE2 transpose, AVX2 gather), each build checks
+//dir_scan_next against the entry by entry rules and dir_read, which then runs on that kernel, against the same rules
+
+#define SCAN_MAX_ENTRIES 80
+
+
+//What dir_read skips: deleted entries, volume labels and LFN parts, and everything from the end marker on
+static int ReferenceNext(const struct SFN *entries, int pos, int count) {
+    for (; pos < count; pos++) {
+        if (entries[pos].filename[0] == 0x0)return count;
+        if (entries[pos].filename[0] == (char) 0xe5 || (entries[pos].file_attributes & (1 << 3)))continue;
+        return pos;
+    }
+    return count;
+}
+
+static void RandomEntries(struct SFN *entries, int count, uint32_t *state) {
+    static const char first[] = {0x0, (char) 0xe5, 'A', '.', 'Z', (char) 0x05};
+    static const uint8_t attributes[] = {0x00, 0x08, 0x0f, 0x10, 0x20, 0x28};
+    for (int i = 0; i < count; i++) {
+        TestEntry(entries + i, "FILE    BIN", attributes[TestRandom(state) % sizeof(attributes)], 0,
+                  TestRandom(state) % 3);
+        //end markers are rare, so most arrays have entries far into them
+        entries[i].filename[0] = TestRandom(state) % 16 ? first[1 + TestRandom(state) % (sizeof(first) - 1)] : first[0];
+    }
+}
+
+static void CheckRandomArrays(void) {
+    uint32_t state = 12345;
+    struct SFN entries[SCAN_MAX_ENTRIES];
+    for (int count = 0; count <= SCAN_MAX_ENTRIES; count++) {
+        for (int round = 0; round < 50; round++) {
+            RandomEntries(entries, count, &state);
+            for (int pos = 0; pos <= count; pos++)CHECK(dir_scan_next(entries, pos, count) == ReferenceNext(entries, pos, count));
+        }
+    }
+    CHECK(dir_scan_next(NULL, 0, 4) == 4);
+    CHECK(dir_scan_next(entries, -1, 4) == 4);
+}
+
+//A root directory with a label, a long name, deleted and empty entries, a directory, and a stale entry
+//after the end marker, spread over several kernel blocks
+static int CraftedRoot(struct SFN *entries) {
+    int count = 0;
+    TestEntry(entries + count++, "TESTVOLUME ", 0x08, 0, 0);
+    TestEntry(entries + count++, "BPART2     ", 0x0f, 0, 0);
+    entries[count - 1].filename[0] = 0x42;
+    TestEntry(entries + count++, "APART1     ", 0x0f, 0, 0);
+    entries[count - 1].filename[0] = 0x01;
+    TestEntry(entries + count++, "LONGNA~1TXT", 0x20, 2, 10);
+    TestEntry(entries + count++, "_DELETEDTXT", 0x20, 3, 5);
+    entries[count - 1].filename[0] = (char) 0xe5;
+    TestEntry(entries + count++, "EMPTY   TXT", 0x20, 0, 0);
+    TestEntry(entries + count++, "SUBDIR     ", 0x10, 4, 0);
+    for (int i = 0; i < 20; i++) {
+        char name[12];
+        snprintf(name, sizeof(name), "FILE%02d  BIN", i);
+        TestEntry(entries + count++, name, 0x20, (uint16_t) (5 + i), (uint32_t) (i % 5 ? i + 1 : 0));
+        if (i % 3 == 0)entries[count - 1].filename[0] = (char) 0xe5;
+        if (i % 7 == 6)TestEntry(entries + count++, "SECOND  LBL", 0x08, 0, 0);
+    }
+    TestEntry(entries + count++, "\0          ", 0x20, 0, 0);
+    TestEntry(entries + count++, "STALE   TXT", 0x20, 30, 3);
+    return count;
+}
+
+static void CheckDirRead(const char *image, const char *scratch) {
+    const char *copy = TestPath(scratch, "dir_scan.img");
+    struct bootSectorFat boot;
+    struct SFN entries[SCAN_MAX_ENTRIES];
+    int count = CraftedRoot(entries);
+    CHECK(TestCopyFile(image, copy) == 0);
+    CHECK(TestReadBoot(copy, &boot) == 0);
+    CHECK(TestWriteRoot(copy, &boot, entries, count) == 0);
+
+    //dir_read lists files with data first, then the empty ones, each in directory order
+    char expected[SCAN_MAX_ENTRIES][13];
+    int expectedCount = 0;
+    for (int empty = 0; empty < 2; empty++) {
+        for (int i = ReferenceNext(entries, 0, count); i < count; i = ReferenceNext(entries, i + 1, count)) {
+            if ((entries[i].size == 0) == empty)sfn_read_name(entries + i, expected[expectedCount++]);
+        }
+    }
+    CHECK(expectedCount == 16);
+
+    struct disk_t *disk = disk_open_from_file(copy);
+    struct volume_t *volume = disk ? fat_open(disk, 0) : NULL;
+    struct dir_t *dir = volume ? dir_open(volume, "\\") : NULL;
+    CHECK(dir != NULL);
+    if (dir) {
+        struct dir_entry_t entry;
+        int read = 0, result;
+        while ((result = dir_read(dir, &entry)) == 0) {
+            CHECK(read < expectedCount && strcmp(entry.name, expected[read]) == 0);
+            read++;
+        }
+        CHECK(result == 1);
+        CHECK(read == expectedCount);
+        dir_close(dir);
+    }
+    if (volume)fat_close(volume);
+    if (disk)disk_close(disk);
+    remove(copy);
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <image> <scratch>\n", argv[0]);
+        return 2;
+    }
+#if defined(__AVX2__)
+    if (!__builtin_cpu_supports("avx2"))return TEST_SKIPPED;
+#endif
+
+    CheckRandomArrays();
+    CheckDirRead(argv[1], argv[2]);
+    return TestResult();
+}
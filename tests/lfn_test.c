@@ -0,0 +1,235 @@
+#include "test.h"
+#include "lfn.h"
+
+//lfn_test <image> <scratch> - long name decoding on crafted entry arrays, then lookups through a root
+//directory of an image copy
+
+#define LFN_TEST_ENTRIES 64
+
+
+struct crafted_dir_t {
+    struct SFN entries[LFN_TEST_ENTRIES];
+    int count;
+};
+
+//Appends the LFN parts of name (UTF-16 units, terminated) for sfn11, highest order first like a FAT driver
+//writes them. Returns the index of the first part so a test can damage them afterwards
+static int AddLongName(struct crafted_dir_t *dir, const uint16_t *name, const char *sfn11) {
+    int length = 0;
+    while (name[length])length++;
+    int parts = (length + LFN_CHARS_PER_ENTRY - 1) / LFN_CHARS_PER_ENTRY;
+    int first = dir->count;
+    for (int part = parts; part >= 1; part--) {
+        struct LFN entry;
+        uint16_t units[LFN_CHARS_PER_ENTRY];
+        for (int i = 0; i < LFN_CHARS_PER_ENTRY; i++) {
+            int at = (part - 1) * LFN_CHARS_PER_ENTRY + i;
+            units[i] = at < length ? name[at] : at == length ? 0x0000 : 0xffff;
+        }
+        memset(&entry, 0, sizeof(entry));
+        entry.order = (uint8_t) (part | (part == parts ? 0x40 : 0));
+        entry.attributes = 0x0f;
+        entry.checksum = lfn_checksum(sfn11);
+        memcpy(entry.name_1, units, sizeof(entry.name_1));
+        memcpy(entry.name_2, units + 5, sizeof(entry.name_2));
+        memcpy(entry.name_3, units + 11, sizeof(entry.name_3));
+        memcpy(dir->entries + dir->count++, &entry, sizeof(entry));
+    }
+    return first;
+}
+
+static int AddShortName(struct crafted_dir_t *dir, const char *sfn11, uint16_t cluster, uint32_t size) {
+    TestEntry(dir->entries + dir->count, sfn11, 0x20, cluster, size);
+    return dir->count++;
+}
+
+static void Units(const char *ascii, uint16_t *units) {
+    while ((*units++ = (uint8_t) *ascii++));
+}
+
+//The name each entry of dir decodes to, NULL when it has none
+static const char *NameOf(struct crafted_dir_t *dir, int entry, struct lfn_table_t **table) {
+    lfn_table_free(*table);
+    *table = lfn_table_build(dir->entries, dir->count);
+    CHECK(*table != NULL);
+    return lfn_table_name(*table, entry);
+}
+
+static void CheckDecoding(void) {
+    struct lfn_table_t *table = NULL;
+    struct crafted_dir_t dir;
+    uint16_t name[LFN_MAX_ENTRIES * LFN_CHARS_PER_ENTRY + 1];
+    const char *decoded;
+
+    //reference checksums of two 8.3 names
+    CHECK(lfn_checksum("LONGFI~1TXT") == 212);
+    CHECK(lfn_checksum("README  TXT") == 115);
+
+    //two parts, the second padded after its terminator
+    dir.count = 0;
+    Units("Long file name.txt", name);
+    AddLongName(&dir, name, "LONGFI~1TXT");
+    int entry = AddShortName(&dir, "LONGFI~1TXT", 2, 1);
+    decoded = NameOf(&dir, entry, &table);
+    CHECK(decoded && strcmp(decoded, "Long file name.txt") == 0);
+    CHECK(lfn_table_name(table, entry - 1) == NULL);
+
+    //exactly one full part, neither terminator nor padding
+    dir.count = 0;
+    Units("Thirteen.char", name);
+    AddLongName(&dir, name, "THIRTE~1CHA");
+    entry = AddShortName(&dir, "THIRTE~1CHA", 2, 1);
+    decoded = NameOf(&dir, entry, &table);
+    CHECK(decoded && strcmp(decoded, "Thirteen.char") == 0);
+
+    //non-ASCII: two and three byte UTF-8 and a surrogate pair, which becomes four bytes
+    dir.count = 0;
+    const uint16_t wide[] = {0x00c4, 'b', 0x6587, 0xd834, 0xdd1e, '.', 't', 'x', 't', 0};
+    AddLongName(&dir, wide, "B~1     TXT");
+    entry = AddShortName(&dir, "B~1     TXT", 2, 1);
+    decoded = NameOf(&dir, entry, &table);
+    CHECK(decoded && strcmp(decoded, "\xc3\x84" "b" "\xe6\x96\x87" "\xf0\x9d\x84\x9e" ".txt") == 0);
+
+    //checksum of the parts does not match the SFN that follows, a stale name of another file
+    dir.count = 0;
+    Units("Stale long name.txt", name);
+    AddLongName(&dir, name, "OTHER   TXT");
+    entry = AddShortName(&dir, "STALEL~1TXT", 2, 1);
+    CHECK(NameOf(&dir, entry, &table) == NULL);
+
+    //parts that disagree on the checksum among themselves
+    dir.count = 0;
+    int first = AddLongName(&dir, name, "STALEL~1TXT");
+    ((struct LFN *) (dir.entries + first + 1))->checksum ^= 1;
+    entry = AddShortName(&dir, "STALEL~1TXT", 2, 1);
+    CHECK(NameOf(&dir, entry, &table) == NULL);
+
+    //parts stored lowest order first
+    dir.count = 0;
+    first = AddLongName(&dir, name, "STALEL~1TXT");
+    struct SFN swap = dir.entries[first];
+    dir.entries[first] = dir.entries[first + 1];
+    dir.entries[first + 1] = swap;
+    entry = AddShortName(&dir, "STALEL~1TXT", 2, 1);
+    CHECK(NameOf(&dir, entry, &table) == NULL);
+
+    //a part missing from the middle
+    dir.count = 0;
+    Units("A name long enough for three parts.txt", name);
+    first = AddLongName(&dir, name, "ANAMEL~1TXT");
+    dir.entries[first + 1] = dir.entries[first + 2];
+    dir.count--;
+    entry = AddShortName(&dir, "ANAMEL~1TXT", 2, 1);
+    CHECK(NameOf(&dir, entry, &table) == NULL);
+
+    //interrupted by a deleted entry
+    dir.count = 0;
+    first = AddLongName(&dir, name, "ANAMEL~1TXT");
+    dir.entries[first + 1].filename[0] = (char) 0xe5;
+    entry = AddShortName(&dir, "ANAMEL~1TXT", 2, 1);
+    CHECK(NameOf(&dir, entry, &table) == NULL);
+
+    //a long name never belongs to a volume label, nor carries over to the entry after it
+    dir.count = 0;
+    Units("Label", name);
+    AddLongName(&dir, name, "VOLUME     ");
+    TestEntry(dir.entries + dir.count++, "VOLUME     ", 0x08, 0, 0);
+    entry = AddShortName(&dir, "VOLUME     ", 2, 1);
+    CHECK(NameOf(&dir, entry - 1, &table) == NULL);
+    CHECK(NameOf(&dir, entry, &table) == NULL);
+
+    lfn_table_free(table);
+}
+
+//Long names written into the root of an image copy, opened and listed through the volume
+static void CheckVolume(const char *image, const char *scratch) {
+    const char *copy = TestPath(scratch, "lfn.img");
+    struct bootSectorFat boot;
+    CHECK(TestCopyFile(image, copy) == 0);
+    CHECK(TestReadBoot(copy, &boot) == 0);
+
+    //the crafted names reuse the data of the first file with data in the original root
+    struct SFN source;
+    FILE *in = fopen(image, "rb");
+    int found = 0;
+    if (in && fseek(in, TestRootOffset(&boot), SEEK_SET) == 0) {
+        for (int i = 0; !found && i < boot.maximum_number_of_files && fread(&source, sizeof(source), 1, in) == 1; i++) {
+            if (source.filename[0] == 0x0)break;
+            found = source.filename[0] != (char) 0xe5 && !(source.file_attributes & 0x18) && source.size;
+        }
+    }
+    if (in)fclose(in);
+    CHECK(found);
+    if (!found)return;
+
+    struct disk_t *disk = disk_open_from_file(image);
+    struct volume_t *volume = disk ? fat_open(disk, 0) : NULL;
+    char sourceName[13];
+    sfn_read_name(&source, sourceName);
+    char *expected = malloc(source.size);
+    struct file_t *file = volume && expected ? file_open(volume, sourceName) : NULL;
+    CHECK(file && file_read(expected, 1, source.size, file) == source.size);
+    if (file)file_close(file);
+    if (volume)fat_close(volume);
+    if (disk)disk_close(disk);
+
+    struct crafted_dir_t dir;
+    uint16_t name[128];
+    dir.count = 0;
+    Units("Quarterly Report 2024.txt", name);
+    AddLongName(&dir, name, "QUARTE~1TXT");
+    AddShortName(&dir, "QUARTE~1TXT", source.low_order_address_of_first_cluster, source.size);
+    Units("Stale Name.txt", name);
+    AddLongName(&dir, name, "SOMEONE TXT");
+    AddShortName(&dir, "STALEN~1TXT", source.low_order_address_of_first_cluster, source.size);
+    CHECK(TestWriteRoot(copy, &boot, dir.entries, dir.count) == 0);
+
+    disk = disk_open_from_file(copy);
+    volume = disk ? fat_open(disk, 0) : NULL;
+    CHECK(volume != NULL);
+    if (volume && expected) {
+        //case folded, and the 8.3 name keeps working
+        const char *names[] = {"Quarterly Report 2024.txt", "QUARTERLY REPORT 2024.TXT", "quarterly report 2024.txt",
+                               "QUARTE~1.TXT"};
+        char *actual = malloc(source.size);
+        for (size_t i = 0; actual && i < sizeof(names) / sizeof(names[0]); i++) {
+            file = file_open(volume, names[i]);
+            CHECK(file != NULL);
+            if (!file)continue;
+            CHECK(file_read(actual, 1, source.size, file) == source.size);
+            CHECK(memcmp(actual, expected, source.size) == 0);
+            file_close(file);
+        }
+        free(actual);
+        CHECK(file_open(volume, "Quarterly Report 2024") == NULL);
+        CHECK(file_open(volume, "Stale Name.txt") == NULL);
+
+        struct dir_t *root = dir_open(volume, "\\");
+        struct dir_entry_t entry;
+        int listed = 0;
+        while (root && dir_read(root, &entry) == 0) {
+            if (strcmp(entry.name, "QUARTE~1.TXT") == 0)
+                CHECK(entry.long_name && strcmp(entry.long_name, "Quarterly Report 2024.txt") == 0);
+            else
+                CHECK(entry.long_name == NULL);
+            listed++;
+        }
+        CHECK(listed == 2);
+        if (root)dir_close(root);
+    }
+    free(expected);
+    if (volume)fat_close(volume);
+    if (disk)disk_close(disk);
+    remove(copy);
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <image> <scratch>\n", argv[0]);
+        return 2;
+    }
+
+    CheckDecoding();
+    CheckVolume(argv[1], argv[2]);
+    return TestResult();
+}
@@ -0,0 +1,203 @@
+#include "test.h"
+#include "recover.h"
+#include "Fat12Table.h"
+
+//recover_test <image> <scratch> - a copy whose root is replaced with deleted files in every state, a deleted
+//directory holding another one, a live directory with a deleted file, and two signatures in free clusters
+
+#define BLOCK 2048 //first of the clusters the test frees and lays out itself
+#define BLOCK_CLUSTERS 32
+#define PNG_FOOTER_AT (1024 + 100) //offset of IEND from the start of the PNG
+
+
+struct expected_file_t {
+    const char *path;
+    int state;
+    int is_directory;
+    uint16_t first_cluster;
+    size_t clusterCount;
+};
+
+//In path order
+static const struct expected_file_t expectedFiles[] = {
+        {"\\LIVEDIR\\_OST.TXT",    RECOVER_CONTIGUOUS,  0, BLOCK + 9,  1},
+        {"\\_DELETED.TXT",         RECOVER_CONTIGUOUS,  0, BLOCK,      3},
+        {"\\_LDDIR",               RECOVER_CONTIGUOUS,  1, BLOCK + 3,  1},
+        {"\\_LDDIR\\INNER.TXT",    RECOVER_CONTIGUOUS,  0, BLOCK + 4,  1},
+        {"\\_LDDIR\\_ONE.BIN",     RECOVER_CONTIGUOUS,  0, BLOCK + 5,  1},
+        {"\\_LDDIR\\_UB",          RECOVER_CONTIGUOUS,  1, BLOCK + 6,  1},
+        {"\\_LDDIR\\_UB\\_EEP.TXT", RECOVER_CONTIGUOUS, 0, BLOCK + 7,  1},
+        {"\\_MPTY.TXT",            RECOVER_EMPTY,       0, 0,          0},
+        {"\\_RAGMENT.BIN",         RECOVER_FRAGMENTED,  0, BLOCK + 10, 2},
+        {"\\_VERWRIT.TXT",         RECOVER_OVERWRITTEN, 0, BLOCK + 11, 0},
+};
+#define EXPECTED_COUNT (sizeof(expectedFiles) / sizeof(expectedFiles[0]))
+
+
+static void Deleted(struct SFN *entry, const char *name11, uint8_t attributes, uint16_t cluster, uint32_t size) {
+    TestEntry(entry, name11, attributes, cluster, size);
+    entry->filename[0] = (char) 0xe5;
+}
+
+static int CraftImage(const char *image, const char *copy, struct bootSectorFat *boot) {
+    FILE *in = fopen(image, "rb");
+    long size = in && !fseek(in, 0, SEEK_END) ? ftell(in) : -1;
+    uint8_t *data = size > 0 ? malloc(size) : NULL;
+    int err = !data || fseek(in, 0, SEEK_SET) || fread(data, size, 1, in) != 1;
+    if (in)fclose(in);
+    if (err) {
+        free(data);
+        return 1;
+    }
+    memcpy(boot, data, sizeof(*boot));
+
+    uint8_t *fat1 = data + (size_t) boot->size_of_reserved_area * boot->bytes_per_sector;
+    uint8_t *fat2 = fat1 + (size_t) boot->size_of_fat * boot->bytes_per_sector;
+    size_t clusterBytes = (size_t) boot->sectors_per_clusters * boot->bytes_per_sector;
+    uint16_t limit = (uint16_t) ((size - TestClusterOffset(boot, 2)) / clusterBytes + 2);
+
+    //the block is freed, everything in use outside of it stays in use; no free cluster keeps old data
+    for (uint16_t cluster = BLOCK; cluster < BLOCK + BLOCK_CLUSTERS; cluster++)AssignTableValue(cluster, 0, fat1);
+    AssignTableValue(BLOCK + 8, 0xfff, fat1); //LIVEDIR
+    AssignTableValue(BLOCK + 11, 0xfff, fat1); //LIVE.TXT, after the first cluster of _RAGMENT.BIN
+    AssignTableValue(BLOCK + 24, 0xfff, fat1); //ends the JPEG's run
+    memcpy(fat2, fat1, (size_t) boot->size_of_fat * boot->bytes_per_sector);
+    for (uint16_t cluster = 2; cluster < limit; cluster++) {
+        if (!TableValue(cluster, fat1))memset(data + TestClusterOffset(boot, cluster), 0, clusterBytes);
+    }
+
+    struct SFN root[12];
+    int count = 0;
+    TestEntry(root + count++, "RECOVERTEST", 0x08, 0, 0);
+    Deleted(root + count++, "ALONGNAME  ", 0x0f, 0, 0);
+    Deleted(root + count++, "xDELETEDTXT", 0x20, BLOCK, (uint32_t) (2 * clusterBytes + clusterBytes / 2));
+    Deleted(root + count++, "xVERWRITTXT", 0x20, BLOCK + 11, 100);
+    Deleted(root + count++, "xMPTY   TXT", 0x20, 0, 0);
+    Deleted(root + count++, "xRAGMENTBIN", 0x20, BLOCK + 10, (uint32_t) (2 * clusterBytes));
+    Deleted(root + count++, "xLDDIR     ", 0x10, BLOCK + 3, 0);
+    TestEntry(root + count++, "LIVE    TXT", 0x20, BLOCK + 11, 1000);
+    TestEntry(root + count++, "LIVEDIR    ", 0x10, BLOCK + 8, 0);
+    TestEntry(root + count++, "\0          ", 0x20, 0, 0); //end marker, nothing after it is listed
+    Deleted(root + count++, "xFTER   TXT", 0x20, BLOCK + 12, 10);
+    memset(data + TestRootOffset(boot), 0, boot->maximum_number_of_files * sizeof(struct SFN));
+    memcpy(data + TestRootOffset(boot), root, count * sizeof(struct SFN));
+
+    struct SFN entries[5];
+    TestEntry(entries + 0, ".          ", 0x10, BLOCK + 3, 0);
+    TestEntry(entries + 1, "..         ", 0x10, 0, 0);
+    TestEntry(entries + 2, "INNER   TXT", 0x20, BLOCK + 4, 100);
+    Deleted(entries + 3, "xONE    BIN", 0x20, BLOCK + 5, 10);
+    Deleted(entries + 4, "xUB        ", 0x10, BLOCK + 6, 0);
+    memcpy(data + TestClusterOffset(boot, BLOCK + 3), entries, 5 * sizeof(struct SFN));
+    TestEntry(entries + 0, ".          ", 0x10, BLOCK + 6, 0);
+    TestEntry(entries + 1, "..         ", 0x10, BLOCK + 3, 0);
+    Deleted(entries + 2, "xEEP    TXT", 0x20, BLOCK + 7, 5);
+    memcpy(data + TestClusterOffset(boot, BLOCK + 6), entries, 3 * sizeof(struct SFN));
+    TestEntry(entries + 0, ".          ", 0x10, BLOCK + 8, 0);
+    TestEntry(entries + 1, "..         ", 0x10, 0, 0);
+    Deleted(entries + 2, "xOST    TXT", 0x20, BLOCK + 9, 20);
+    memcpy(data + TestClusterOffset(boot, BLOCK + 8), entries, 3 * sizeof(struct SFN));
+
+    //_DELETED.TXT's contents, then the two signatures
+    uint8_t *deleted = data + TestClusterOffset(boot, BLOCK);
+    for (size_t i = 0; i < 3 * clusterBytes; i++)deleted[i] = (uint8_t) ('a' + i % 26);
+    memcpy(data + TestClusterOffset(boot, BLOCK + 16), "\x89PNG\r\n\x1a\n", 8);
+    memcpy(data + TestClusterOffset(boot, BLOCK + 16) + PNG_FOOTER_AT, "IEND\xae\x42\x60\x82", 8);
+    memcpy(data + TestClusterOffset(boot, BLOCK + 20), "\xff\xd8\xff\xe0", 4);
+
+    err = TestCopyFile(image, copy) || TestPatch(copy, 0, data, size);
+    free(data);
+    return err;
+}
+
+static int CompareFiles(const void *a, const void *b) {
+    return strcmp(((const struct recovered_file_t *) a)->path, ((const struct recovered_file_t *) b)->path);
+}
+
+static const struct recovered_file_t *FindFile(const struct recovery_report_t *report, const char *path) {
+    for (size_t i = 0; i < report->fileCount; i++) {
+        if (strcmp(report->files[i].path, path) == 0)return report->files + i;
+    }
+    return NULL;
+}
+
+static void CheckReport(struct recovery_report_t *report) {
+    CHECK(report->fileCount == EXPECTED_COUNT);
+    if (report->fileCount != EXPECTED_COUNT)return;
+    qsort(report->files, report->fileCount, sizeof(struct recovered_file_t), CompareFiles);
+    for (size_t i = 0; i < EXPECTED_COUNT; i++) {
+        const struct recovered_file_t *file = report->files + i;
+        const struct expected_file_t *expected = expectedFiles + i;
+        CHECK(strcmp(file->path, expected->path) == 0);
+        CHECK(file->state == expected->state);
+        CHECK(file->is_directory == expected->is_directory);
+        CHECK(file->clusterCount == expected->clusterCount);
+        if (file->clusterCount)CHECK(file->clusters[0] == expected->first_cluster);
+    }
+    //the fragmented run skips LIVE.TXT's cluster
+    const struct recovered_file_t *fragmented = FindFile(report, "\\_RAGMENT.BIN");
+    CHECK(fragmented && fragmented->clusterCount == 2 && fragmented->clusters[1] == BLOCK + 12);
+
+    CHECK(report->carvedCount == 2);
+    if (report->carvedCount == 2) {
+        CHECK(report->carved[0].first_cluster == BLOCK + 16);
+        CHECK(report->carved[0].clusters == 4);
+        CHECK(strcmp(report->carved[0].extension, "png") == 0);
+        CHECK(report->carved[1].first_cluster == BLOCK + 20);
+        CHECK(report->carved[1].clusters == 4);
+        CHECK(strcmp(report->carved[1].extension, "jpg") == 0);
+    }
+}
+
+static long ReadOutput(const char *file_name, char *data, size_t capacity) {
+    FILE *file = fopen(file_name, "rb");
+    if (!file)return -1;
+    size_t read = fread(data, 1, capacity, file);
+    fclose(file);
+    return (long) read;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <image> <scratch>\n", argv[0]);
+        return 2;
+    }
+
+    char copy[4096], output[4096];
+    snprintf(copy, sizeof(copy), "%s", TestPath(argv[2], "recover.img"));
+    snprintf(output, sizeof(output), "%s", TestPath(argv[2], "recovered.bin"));
+    struct bootSectorFat boot;
+    CHECK(CraftImage(argv[1], copy, &boot) == 0);
+
+    struct disk_t *disk = disk_open_from_file(copy);
+    struct volume_t *volume = disk ? fat_open(disk, 0) : NULL;
+    CHECK(volume != NULL);
+    for (int threads = 1; volume && threads <= 4; threads += 3) {
+        struct recovery_report_t *report = fat_recover_scan(volume, threads);
+        CHECK(report != NULL);
+        if (!report)continue;
+        CheckReport(report);
+
+        //extraction cuts the guessed run to the entry's size, carving cuts at the PNG footer
+        static char data[8192];
+        const struct recovered_file_t *deleted = FindFile(report, "\\_DELETED.TXT");
+        const struct recovered_file_t *empty = FindFile(report, "\\_MPTY.TXT");
+        CHECK(deleted && fat_recover_extract(volume, deleted, output) == 0);
+        CHECK(deleted && ReadOutput(output, data, sizeof(data)) == (long) deleted->entry.size);
+        CHECK(memcmp(data, "abcdefghijklmnopqrstuvwxyz", 26) == 0);
+        CHECK(empty && fat_recover_extract(volume, empty, output) == -1);
+        if (report->carvedCount == 2) {
+            CHECK(fat_carve_extract(volume, report->carved + 0, output) == 0);
+            CHECK(ReadOutput(output, data, sizeof(data)) == PNG_FOOTER_AT + 8);
+            CHECK(memcmp(data, "\x89PNG\r\n\x1a\n", 8) == 0);
+        }
+        fat_recover_free(report);
+    }
+    CHECK(fat_recover_scan(NULL, 1) == NULL);
+
+    if (volume)fat_close(volume);
+    if (disk)disk_close(disk);
+    remove(output);
+    remove(copy);
+    return TestResult();
+}
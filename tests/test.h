@@ -0,0 +1,103 @@
+#ifndef FAT_TESTS_TEST_H
+#define FAT_TESTS_TEST_H
+#include "file_reader.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//Shared by the CTest executables. A failed CHECK reports where and the test keeps going, TestResult
+//turns the failures into the exit code. Every test gets the source image and a scratch directory,
+//images are modified only as copies in the scratch directory
+
+#define TEST_SKIPPED 77 //SKIP_RETURN_CODE of the tests
+
+static int testFailures;
+
+#define CHECK(condition) do { \
+    if (!(condition)) { \
+        fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+        testFailures++; \
+    } \
+} while (0)
+
+static inline int TestResult(void) {
+    if (testFailures)fprintf(stderr, "%d checks failed\n", testFailures);
+    return testFailures ? 1 : 0;
+}
+
+//scratch/name, in a static buffer
+static inline const char *TestPath(const char *scratch, const char *name) {
+    static char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", scratch, name);
+    return path;
+}
+
+//Deterministic, so a failure reproduces
+static inline uint32_t TestRandom(uint32_t *state) {
+    *state = *state * 1664525u + 1013904223u;
+    return *state >> 8;
+}
+
+static inline int TestCopyFile(const char *source, const char *destination) {
+    FILE *in = fopen(source, "rb");
+    FILE *out = in ? fopen(destination, "wb") : NULL;
+    char buffer[65536];
+    size_t count;
+    int err = !in || !out;
+    while (!err && (count = fread(buffer, 1, sizeof(buffer), in)) > 0)err = fwrite(buffer, 1, count, out) != count;
+    if (in && ferror(in))err = 1;
+    if (in)fclose(in);
+    if (out && fclose(out))err = 1;
+    return err;
+}
+
+//Writes size bytes at offset of an image copy, the reader itself never writes a raw image
+static inline int TestPatch(const char *image, long offset, const void *data, size_t size) {
+    FILE *file = fopen(image, "r+b");
+    int err = !file || fseek(file, offset, SEEK_SET) || fwrite(data, 1, size, file) != size;
+    if (file && fclose(file))err = 1;
+    return err;
+}
+
+static inline int TestReadBoot(const char *image, struct bootSectorFat *boot) {
+    FILE *file = fopen(image, "rb");
+    int err = !file || fread(boot, sizeof(*boot), 1, file) != 1;
+    if (file)fclose(file);
+    return err;
+}
+
+static inline long TestRootOffset(const struct bootSectorFat *boot) {
+    return (long) (boot->size_of_reserved_area + boot->number_of_fats * boot->size_of_fat) * boot->bytes_per_sector;
+}
+
+static inline long TestClusterOffset(const struct bootSectorFat *boot, uint16_t cluster) {
+    long data = TestRootOffset(boot) + (long) boot->maximum_number_of_files * sizeof(struct SFN);
+    return data + (long) (cluster - 2) * boot->sectors_per_clusters * boot->bytes_per_sector;
+}
+
+//Replaces the root directory with count entries, the rest of it left free
+static inline int TestWriteRoot(const char *image, const struct bootSectorFat *boot, const struct SFN *entries,
+                                size_t count) {
+    size_t size = boot->maximum_number_of_files * sizeof(struct SFN);
+    char *root = calloc(1, size);
+    if (!root || count * sizeof(struct SFN) > size) {
+        free(root);
+        return 1;
+    }
+    memcpy(root, entries, count * sizeof(struct SFN));
+    int err = TestPatch(image, TestRootOffset(boot), root, size);
+    free(root);
+    return err;
+}
+
+static inline void TestEntry(struct SFN *entry, const char *name11, uint8_t attributes, uint16_t cluster,
+                             uint32_t size) {
+    memset(entry, 0, sizeof(*entry));
+    memcpy(entry->filename, name11, 11);
+    entry->file_attributes = attributes;
+    entry->low_order_address_of_first_cluster = cluster;
+    entry->size = size;
+}
+
+#endif
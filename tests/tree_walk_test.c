@@ -0,0 +1,225 @@
+#include "test.h"
+#include "tree_walk.h"
+
+#include <pthread.h>
+
+//tree_walk_test <image> <scratch> - fat_walk on one thread and on a pool, with pruning, stopping and
+//max_depth, checked against the order and the set of entries a plain depth first walk gives
+
+#define WALK_THREADS 4
+
+
+struct walk_event_t {
+    char path[FAT_WALK_PATH_LENGTH];
+    int depth;
+    int is_directory;
+    int post;
+};
+
+struct walk_log_t {
+    pthread_mutex_t lock;
+    struct walk_event_t *events;
+    int count;
+    int capacity;
+    int pruneDepth; //directories at this depth are pruned, 0 for none
+    int stopAfter; //pre returns FAT_WALK_STOP on this call, 0 for never
+    int preCount;
+};
+
+static int Record(const struct fat_walk_entry_t *entry, struct walk_log_t *log, int post) {
+    pthread_mutex_lock(&log->lock);
+    if (log->count == log->capacity) {
+        int capacity = log->capacity ? log->capacity * 2 : 1024;
+        struct walk_event_t *events = realloc(log->events, capacity * sizeof(struct walk_event_t));
+        if (!events) {
+            pthread_mutex_unlock(&log->lock);
+            return -1;
+        }
+        log->events = events;
+        log->capacity = capacity;
+    }
+    struct walk_event_t *event = log->events + log->count++;
+    snprintf(event->path, sizeof(event->path), "%s", entry->path);
+    event->depth = entry->depth;
+    event->is_directory = entry->is_directory;
+    event->post = post;
+    int pre = post ? 0 : ++log->preCount;
+    pthread_mutex_unlock(&log->lock);
+    return pre;
+}
+
+static int Pre(const struct fat_walk_entry_t *entry, void *context) {
+    struct walk_log_t *log = context;
+    int pre = Record(entry, log, 0);
+    if (pre == -1)return FAT_WALK_STOP;
+    if (log->stopAfter && pre == log->stopAfter)return FAT_WALK_STOP;
+    if (entry->is_directory && entry->depth == log->pruneDepth)return FAT_WALK_PRUNE;
+    return FAT_WALK_CONTINUE;
+}
+
+static int Post(const struct fat_walk_entry_t *entry, void *context) {
+    return Record(entry, context, 1) == -1 ? FAT_WALK_STOP : FAT_WALK_CONTINUE;
+}
+
+static int Walk(struct volume_t *volume, struct walk_log_t *log, int threads, int maxDepth) {
+    struct fat_walk_options_t options = {Pre, Post, log, maxDepth, threads};
+    log->count = 0;
+    log->preCount = 0;
+    return fat_walk(volume, &options);
+}
+
+static int ComparePaths(const void *a, const void *b) {
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+//Paths of the pre events, sorted, so walks on different thread counts compare as sets
+static char **SortedPaths(const struct walk_log_t *log, int *count) {
+    char **paths = malloc((log->count ? log->count : 1) * sizeof(char *));
+    *count = 0;
+    if (!paths)return NULL;
+    for (int i = 0; i < log->count; i++) {
+        if (!log->events[i].post)paths[(*count)++] = log->events[i].path;
+    }
+    qsort(paths, *count, sizeof(char *), ComparePaths);
+    return paths;
+}
+
+static int FindEvent(const struct walk_log_t *log, const char *path, int post) {
+    for (int i = 0; i < log->count; i++) {
+        if (log->events[i].post == post && strcmp(log->events[i].path, path) == 0)return i;
+    }
+    return -1;
+}
+
+//Every entry once, below its parent's pre and above its parent's post; every directory gets one post,
+//after its pre. Depth is the number of components of the path
+static void CheckNesting(const struct walk_log_t *log) {
+    for (int i = 0; i < log->count; i++) {
+        const struct walk_event_t *event = log->events + i;
+        int components = 0;
+        for (const char *c = event->path; *c; c++)components += *c == '\\';
+        CHECK(components == event->depth);
+        CHECK(FindEvent(log, event->path, event->post) == i);
+        if (event->post) {
+            CHECK(event->is_directory);
+            int pre = FindEvent(log, event->path, 0);
+            CHECK(pre != -1 && pre < i);
+            continue;
+        }
+        if (event->is_directory)CHECK(FindEvent(log, event->path, 1) > i);
+        if (event->depth == 1)continue;
+
+        char parent[FAT_WALK_PATH_LENGTH];
+        snprintf(parent, sizeof(parent), "%s", event->path);
+        *strrchr(parent, '\\') = '\0';
+        int parentPre = FindEvent(log, parent, 0), parentPost = FindEvent(log, parent, 1);
+        CHECK(parentPre != -1 && parentPre < i);
+        CHECK(parentPost > i);
+    }
+}
+
+static int CountPre(const struct walk_log_t *log, int maxDepth, int directories) {
+    int count = 0;
+    for (int i = 0; i < log->count; i++) {
+        const struct walk_event_t *event = log->events + i;
+        if (!event->post && (!maxDepth || event->depth <= maxDepth) && (!directories || event->is_directory))count++;
+    }
+    return count;
+}
+
+//full holds a complete single thread walk, filtered to maxDepth. Ordered, log's entries are the first of
+//full's in the same order; otherwise they are the same set
+static void CheckSameEntries(const struct walk_log_t *full, const struct walk_log_t *log, int maxDepth, int ordered) {
+    if (ordered) {
+        int at = 0;
+        for (int i = 0; i < log->count; i++) {
+            if (log->events[i].post)continue;
+            while (at < full->count &&
+                   (full->events[at].post || (maxDepth && full->events[at].depth > maxDepth)))at++;
+            CHECK(at < full->count && strcmp(log->events[i].path, full->events[at].path) == 0);
+            at++;
+        }
+        return;
+    }
+    int fullCount, count;
+    char **fullPaths = SortedPaths(full, &fullCount), **paths = SortedPaths(log, &count);
+    CHECK(fullPaths && paths);
+    int at = 0;
+    for (int i = 0; fullPaths && paths && i < fullCount; i++) {
+        const struct walk_event_t *event = full->events + FindEvent(full, fullPaths[i], 0);
+        if (maxDepth && event->depth > maxDepth)continue;
+        CHECK(at < count && strcmp(paths[at], fullPaths[i]) == 0);
+        at++;
+    }
+    free(fullPaths);
+    free(paths);
+}
+
+static void CheckWalks(struct volume_t *volume) {
+    struct walk_log_t full = {PTHREAD_MUTEX_INITIALIZER}, log = {PTHREAD_MUTEX_INITIALIZER};
+
+    //fat12test.img: 1045 entries, 914 of them files, nested more than two levels deep
+    CHECK(Walk(volume, &full, 1, 0) == 0);
+    CHECK(CountPre(&full, 0, 0) == 1045);
+    CHECK(CountPre(&full, 0, 0) - CountPre(&full, 0, 1) == 914);
+    CHECK(CountPre(&full, 2, 0) < 1045);
+    CheckNesting(&full);
+
+    for (int threads = 1; threads <= WALK_THREADS; threads += WALK_THREADS - 1) {
+        //the pool walks the same entries, with every subtree still bracketed by its directory
+        CHECK(Walk(volume, &log, threads, 0) == 0);
+        CHECK(CountPre(&log, 0, 0) == 1045);
+        CheckSameEntries(&full, &log, 0, threads == 1);
+        CheckNesting(&log);
+
+        //max_depth lists the directories at the limit but nothing below them
+        for (int depth = 1; depth <= 2; depth++) {
+            CHECK(Walk(volume, &log, threads, depth) == 0);
+            CHECK(CountPre(&log, 0, 0) == CountPre(&full, depth, 0));
+            CheckSameEntries(&full, &log, depth, threads == 1);
+            CheckNesting(&log);
+        }
+
+        //pruning a level walks what max_depth at that level does, post included
+        log.pruneDepth = 2;
+        CHECK(Walk(volume, &log, threads, 0) == 0);
+        CHECK(CountPre(&log, 0, 0) == CountPre(&full, 2, 0));
+        CheckSameEntries(&full, &log, 2, threads == 1);
+        CheckNesting(&log);
+        log.pruneDepth = 0;
+
+        //a stop ends the walk early with its own result; on one thread nothing is called after it
+        log.stopAfter = 100;
+        CHECK(Walk(volume, &log, threads, 0) == FAT_WALK_STOP);
+        CHECK(log.preCount < 1045);
+        if (threads == 1) {
+            CHECK(log.preCount == 100);
+            CHECK(log.count > 0 && !log.events[log.count - 1].post);
+            CheckSameEntries(&full, &log, 0, 1);
+        }
+        log.stopAfter = 0;
+    }
+
+    free(full.events);
+    free(log.events);
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <image> <scratch>\n", argv[0]);
+        return 2;
+    }
+
+    struct disk_t *disk = disk_open_from_file(argv[1]);
+    struct volume_t *volume = disk ? fat_open(disk, 0) : NULL;
+    CHECK(volume != NULL);
+    if (volume)CheckWalks(volume);
+
+    struct fat_walk_options_t options = {Pre, Post, NULL, 0, 1};
+    CHECK(fat_walk(NULL, &options) == -1);
+    CHECK(volume == NULL || fat_walk(volume, NULL) == -1);
+
+    if (volume)fat_close(volume);
+    if (disk)disk_close(disk);
+    return TestResult();
+}
@@ -0,0 +1,332 @@
+#include "tree_walk.h"
+#include "dir_scan.h"
+#include "lfn.h"
+#include "parallel.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+
+//A directory being walked. pending counts its own listing plus every entered subdirectory not finished yet,
+//whoever drops it to zero calls post and releases the parent
+struct WalkNode {
+    struct WalkNode *parent;
+    int pending;
+    int depth;
+    struct clusters_chain_t *chain; //NULL for the root
+    struct SFN entry;
+    char *longName;
+    const char *name;
+    char path[];
+};
+
+struct Walk {
+    struct volume_t *volume;
+    const struct fat_walk_options_t *options;
+    size_t clusterBytes;
+    uint8_t *entered; //per cluster, first clusters of directories already entered
+    uint32_t clusterLimit;
+    int stop; //FAT_WALK_STOP or -1, set once
+    int error;
+
+    int threads;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    struct WalkNode **queue;
+    size_t queued;
+    size_t queueCapacity;
+    size_t active; //nodes queued or being listed
+};
+
+static int Stopped(struct Walk *walk) {
+    return __atomic_load_n(&walk->stop, __ATOMIC_RELAXED) != 0;
+}
+
+static void Stop(struct Walk *walk, int reason, int error) {
+    int expected = 0;
+    if (__atomic_compare_exchange_n(&walk->stop, &expected, reason, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        walk->error = error;
+}
+
+static void FreeChain(struct clusters_chain_t *chain) {
+    if (!chain)return;
+    free(chain->clusters);
+    free(chain);
+}
+
+static void FillEntry(struct fat_walk_entry_t *entry, const struct WalkNode *node) {
+    entry->path = node->path;
+    entry->name = node->name;
+    entry->long_name = node->longName;
+    entry->sfn = &node->entry;
+    entry->depth = node->depth;
+    entry->is_directory = 1;
+}
+
+static void Release(struct Walk *walk, struct WalkNode *node) {
+    while (node && __atomic_sub_fetch(&node->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+        struct WalkNode *parent = node->parent;
+        if (parent && walk->options->post && !Stopped(walk)) {
+            struct fat_walk_entry_t entry;
+            FillEntry(&entry, node);
+            if (walk->options->post(&entry, walk->options->context) == FAT_WALK_STOP)Stop(walk, FAT_WALK_STOP, 0);
+        }
+        FreeChain(node->chain);
+        free(node->longName);
+        free(node);
+        node = parent;
+    }
+}
+
+//Asks the kernel to start reading a directory's clusters now, it is listed later, by this or another thread
+static void Prefetch(struct Walk *walk, const struct clusters_chain_t *chain) {
+    struct disk_t *disk = walk->volume->disk;
+    if (disk->ops)return;
+    for (size_t i = 0; i < chain->size;) {
+        size_t run = 1;
+        while (i + run < chain->size && chain->clusters[i + run] == chain->clusters[i] + run)run++;
+        posix_fadvise(disk->diskFD, (off_t) fat_cluster_sector(walk->volume, chain->clusters[i]) * SECTOR_SIZE,
+                      (off_t) (run * walk->clusterBytes), POSIX_FADV_WILLNEED);
+        i += run;
+    }
+}
+
+static char *ReadDirectory(struct Walk *walk, const struct clusters_chain_t *chain) {
+    char *result = malloc(chain->size * walk->clusterBytes);
+    if (!result)return NULL;
+    uint8_t sectorsPerCluster = walk->volume->fatInfo.sectors_per_clusters;
+    for (size_t i = 0; i < chain->size;) {
+        size_t run = 1;
+        while (i + run < chain->size && chain->clusters[i + run] == chain->clusters[i] + run)run++;
+        if (disk_read(walk->volume->disk, fat_cluster_sector(walk->volume, chain->clusters[i]),
+                      result + i * walk->clusterBytes, (int32_t) (run * sectorsPerCluster)) == -1) {
+            free(result);
+            return NULL;
+        }
+        i += run;
+    }
+    return result;
+}
+
+static void Enqueue(struct Walk *walk, struct WalkNode *node);
+
+static struct WalkNode *NewNode(struct WalkNode *parent, const struct SFN *entry, const char *name,
+                                const char *longName, struct clusters_chain_t *chain) {
+    size_t length = strlen(parent->path) + 1 + strlen(name);
+    if (length >= FAT_WALK_PATH_LENGTH) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    struct WalkNode *result = malloc(sizeof(struct WalkNode) + length + 1);
+    if (!result) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    result->longName = longName ? strdup(longName) : NULL;
+    if (longName && !result->longName) {
+        free(result);
+        errno = ENOMEM;
+        return NULL;
+    }
+    sprintf(result->path, "%s\\%s", parent->path, name);
+    result->name = result->path + length - strlen(name);
+    result->parent = parent;
+    result->pending = 1;
+    result->depth = parent->depth + 1;
+    result->chain = chain;
+    result->entry = *entry;
+    return result;
+}
+
+//Lists one directory: prefetches every subdirectory, then calls pre in directory order and enters
+//subdirectories, recursively on one thread or through the queue on several
+static void ListDirectory(struct Walk *walk, struct WalkNode *node) {
+    const struct fat_walk_options_t *options = walk->options;
+    const struct SFN *entries = walk->volume->rootDirectory;
+    int count = walk->volume->fatInfo.maximum_number_of_files;
+    char *data = NULL;
+    struct lfn_table_t *longNames = NULL;
+    struct clusters_chain_t **chains = NULL;
+
+    if (Stopped(walk))goto done;
+    if (node->chain) {
+        data = ReadDirectory(walk, node->chain);
+        if (!data) {
+            Stop(walk, -1, errno);
+            goto done;
+        }
+        entries = (const struct SFN *) data;
+        count = (int) (node->chain->size * walk->clusterBytes / sizeof(struct SFN));
+    }
+    longNames = lfn_table_build(entries, count);
+    chains = calloc(count ? count : 1, sizeof(struct clusters_chain_t *));
+    if (!longNames || !chains) {
+        Stop(walk, -1, ENOMEM);
+        goto done;
+    }
+
+    int enter = !options->max_depth || node->depth + 1 < options->max_depth;
+    for (int i = dir_scan_next(entries, 0, count); enter && i < count; i = dir_scan_next(entries, i + 1, count)) {
+        if (entries[i].filename[0] == '.' || !(entries[i].file_attributes & (1 << 4)))continue;
+        uint16_t first = entries[i].low_order_address_of_first_cluster;
+        if (first < 2 || first >= walk->clusterLimit)continue;
+        chains[i] = get_chain_fat12(walk->volume->FAT1, walk->volume->fatInfo.size_of_fat * walk->volume->fatInfo.bytes_per_sector,
+                                    first);
+        if (chains[i])Prefetch(walk, chains[i]);
+    }
+
+    for (int i = dir_scan_next(entries, 0, count); i < count && !Stopped(walk); i = dir_scan_next(entries, i + 1, count)) {
+        if (entries[i].filename[0] == '.')continue;
+
+        char name[13];
+        sfn_read_name(entries + i, name);
+        struct WalkNode *child = NewNode(node, entries + i, name, lfn_table_name(longNames, i), chains[i]);
+        if (!child) {
+            Stop(walk, -1, errno);
+            break;
+        }
+        chains[i] = NULL;
+
+        int visit = FAT_WALK_CONTINUE;
+        if (options->pre) {
+            struct fat_walk_entry_t entry;
+            FillEntry(&entry, child);
+            entry.is_directory = (entries[i].file_attributes & (1 << 4)) != 0;
+            visit = options->pre(&entry, options->context);
+        }
+        if (visit == FAT_WALK_STOP)Stop(walk, FAT_WALK_STOP, 0);
+
+        if (!(entries[i].file_attributes & (1 << 4))) {
+            FreeChain(child->chain);
+            free(child->longName);
+            free(child);
+            continue;
+        }
+
+        uint16_t first = entries[i].low_order_address_of_first_cluster;
+        if (visit == FAT_WALK_CONTINUE && child->chain &&
+            !__atomic_exchange_n(walk->entered + first, 1, __ATOMIC_RELAXED)) {
+            __atomic_add_fetch(&node->pending, 1, __ATOMIC_RELAXED);
+            if (walk->threads > 1)Enqueue(walk, child);
+            else ListDirectory(walk, child);
+            continue;
+        }
+        //not entered: post follows right away, nothing is below it
+        __atomic_add_fetch(&node->pending, 1, __ATOMIC_RELAXED);
+        Release(walk, child);
+    }
+
+done:
+    if (chains) {
+        for (int i = 0; i < count; i++)FreeChain(chains[i]);
+    }
+    free(chains);
+    lfn_table_free(longNames);
+    free(data);
+    Release(walk, node);
+}
+
+
+static void Enqueue(struct Walk *walk, struct WalkNode *node) {
+    pthread_mutex_lock(&walk->lock);
+    if (walk->queued == walk->queueCapacity) {
+        size_t capacity = walk->queueCapacity ? walk->queueCapacity * 2 : 64;
+        struct WalkNode **queue = realloc(walk->queue, capacity * sizeof(struct WalkNode *));
+        if (!queue) {
+            pthread_mutex_unlock(&walk->lock);
+            //listing it here keeps the tree whole, only the parallelism is lost
+            ListDirectory(walk, node);
+            return;
+        }
+        walk->queue = queue;
+        walk->queueCapacity = capacity;
+    }
+    walk->queue[walk->queued++] = node;
+    walk->active++;
+    pthread_cond_signal(&walk->wake);
+    pthread_mutex_unlock(&walk->lock);
+}
+
+//Newest first, so the walk stays close to depth first and the queue short
+static void *WalkWorker(void *arg) {
+    struct Walk *walk = arg;
+    pthread_mutex_lock(&walk->lock);
+    while (1) {
+        while (!walk->queued && walk->active)pthread_cond_wait(&walk->wake, &walk->lock);
+        if (!walk->queued)break;
+        struct WalkNode *node = walk->queue[--walk->queued];
+        pthread_mutex_unlock(&walk->lock);
+
+        ListDirectory(walk, node);
+
+        pthread_mutex_lock(&walk->lock);
+        if (--walk->active == 0)pthread_cond_broadcast(&walk->wake);
+    }
+    pthread_mutex_unlock(&walk->lock);
+    return NULL;
+}
+
+
+int fat_walk(struct volume_t *pvolume, const struct fat_walk_options_t *options) {
+    if (!pvolume || !options) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    struct Walk walk;
+    memset(&walk, 0, sizeof(walk));
+    walk.volume = pvolume;
+    walk.options = options;
+    walk.clusterBytes = (size_t) pvolume->fatInfo.sectors_per_clusters * SECTOR_SIZE;
+    walk.clusterLimit = pvolume->fatInfo.size_of_fat * pvolume->fatInfo.bytes_per_sector / 3 * 2;
+    walk.threads = parallel_thread_count(options->threads);
+    walk.entered = calloc(walk.clusterLimit ? walk.clusterLimit : 1, 1);
+    struct WalkNode *root = calloc(1, sizeof(struct WalkNode) + 1);
+    if (!walk.entered || !root) {
+        free(walk.entered);
+        free(root);
+        errno = ENOMEM;
+        return -1;
+    }
+    root->pending = 1;
+
+    if (walk.threads > 1) {
+        walk.queueCapacity = 64;
+        walk.queue = malloc(sizeof(struct WalkNode *) * walk.queueCapacity);
+        if (!walk.queue)walk.threads = 1;
+    }
+
+    if (walk.threads <= 1) {
+        ListDirectory(&walk, root);
+    } else {
+        pthread_mutex_init(&walk.lock, NULL);
+        pthread_cond_init(&walk.wake, NULL);
+        walk.queue[walk.queued++] = root;
+        walk.active = 1;
+
+        //the calling thread is one of the workers, the walk still completes when none can be started
+        pthread_t *workers = malloc(sizeof(pthread_t) * (walk.threads - 1));
+        int started = 0;
+        for (; workers && started < walk.threads - 1; started++) {
+            if (pthread_create(workers + started, NULL, WalkWorker, &walk))break;
+        }
+        WalkWorker(&walk);
+        for (int i = 0; i < started; i++)pthread_join(workers[i], NULL);
+
+        free(workers);
+        free(walk.queue);
+        pthread_cond_destroy(&walk.wake);
+        pthread_mutex_destroy(&walk.lock);
+    }
+
+    free(walk.entered);
+    if (walk.stop == -1) {
+        errno = walk.error;
+        return -1;
+    }
+    return walk.stop;
+}
@@ -0,0 +1,38 @@
+#ifndef FAT_TREE_WALK_H
+#define FAT_TREE_WALK_H
+#include "file_reader.h"
+
+#define FAT_WALK_CONTINUE 0
+#define FAT_WALK_PRUNE 1 //from pre on a directory: do not enter it, post still follows
+#define FAT_WALK_STOP 2 //end the walk, fat_walk returns FAT_WALK_STOP
+
+#define FAT_WALK_PATH_LENGTH 1024
+
+//Valid for the duration of the callback only
+struct fat_walk_entry_t {
+    const char *path; //from the root, "\\DIR\\FILE.TXT"
+    const char *name; //last component of path, 8.3
+    const char *long_name; //NULL when the entry has none
+    const struct SFN *sfn;
+    int depth; //1 for the entries of the root directory
+    int is_directory;
+};
+
+typedef int (*fat_walk_callback_t)(const struct fat_walk_entry_t *entry, void *context);
+
+struct fat_walk_options_t {
+    fat_walk_callback_t pre; //every file and directory, before the contents of a directory
+    fat_walk_callback_t post; //directories only, after everything below them
+    void *context;
+    int max_depth; //directories at this depth are visited but not entered, 0 for no limit
+    int threads; //1 walks depth first in directory order on the calling thread, 0 = one per online CPU
+};
+
+//nftw for a mounted volume. With more than one thread, subdirectories are handed to a pool and callbacks
+//for different subtrees run concurrently; pre of a directory still comes before anything below it and
+//post after. Every directory's chain is prefetched when its parent is listed, before it is entered.
+//A directory reached twice (cross-linked or looping chains) is visited but entered only once.
+//Returns 0 when the whole tree was walked, FAT_WALK_STOP when a callback stopped it, -1 with errno on error
+int fat_walk(struct volume_t *pvolume, const struct fat_walk_options_t *options);
+
+#endif